@@ -4,11 +4,23 @@ CDA3101 Project 3 - MIPS Simulator
 September 24, 2017
 
 This program simulates a MIPS simulator by reading an object file output by the MIPS assembler.
-The simulation then outputs any valid information the standard out.
+The simulation then outputs any valid information the standard out.  A file ending in .asm is
+instead assembled in-process (see assembleFile) and simulated exactly as its object file would be.
  
 In addition, a log.txt file is generated contianing the parsing of each line along with the state
 of the registers at the point of execution of the corresponding line.
 
+Usage: sim.exe <file.obj|file.asm> [-notrace] [-maxinst n] [-maxtime ms] [-maxlog bytes] [-maxmem words]
+The optional limits stop a runaway program with a distinct exit status and a final register and
+data memory dump.  Limits are checked at basic block boundaries, and the wall-clock time is only
+sampled every LIMITCHECKINTERVAL basic blocks.
+"sim.exe -serve <socket>" starts a simulation server and "sim.exe -client <socket> <file> [options]"
+runs a job through it in place of a direct invocation (see runServer).
+With -notrace the per-instruction trace is omitted from log.txt, which also allows hot loops of
+simple register arithmetic to be fast-forwarded (see analyzeLoop).
+"sim.exe <file> -notrace -batch <list> [-lanes k]" runs the program over every input file named in
+<list>, k inputs at a time in lock-step (see runBatch).
+
 Note that the code is self-documenting.
 */
 
@@ -18,16 +30,192 @@ Note that the code is self-documenting.
 #include <string>
 #include <vector>
 #include <map>
+#include <sstream>
+#include <stdexcept>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <cerrno>
+#include <list>
+#include <algorithm>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
 const size_t MAXPROGRAM = 32768;
 
-//typedef support for table mappings
-typedef std::pair<const unsigned int,const std::string> codePair;
-typedef std::pair<const unsigned int, const unsigned int> opcodeFunctPair;
-typedef std::pair<const opcodeFunctPair, const std::string> codePairFunctTable;
+//exit statuses used when a resource limit stops the simulation (faults use EXIT_FAILURE)
+const int EXIT_INST_LIMIT = 2;
+const int EXIT_TIME_LIMIT = 3;
+const int EXIT_LOG_LIMIT = 4;
+const int EXIT_MEM_LIMIT = 5;
+
+//size of the buffer used to format the data memory dump
+const size_t DUMPBUFFERSIZE = 65536;
+
+//number of basic blocks between wall-clock checks
+const unsigned int LIMITCHECKINTERVAL = 1024;
+
+//defaults for the simulation server: concurrent jobs and decoded programs kept in the cache
+const size_t DEFAULTWORKERS = 4;
+const size_t DEFAULTCACHESIZE = 64;
+
+//largest job request accepted by the simulation server, in bytes
+const size_t MAXREQUEST = 65536;
+
+//default and largest number of lanes run together in batch mode
+const size_t DEFAULTLANES = 8;
+const size_t MAXLANES = 64;
+
+//number of times a backward branch or jump must be taken before its loop is analyzed
+const unsigned int HOTLOOPTHRESHOLD = 16;
+
+//an affine function of the register values at the start of a loop iteration: one coefficient
+//per register followed by a constant term, all modulo 2^32
+const size_t AFFINECONST = 34;
+typedef std::vector<unsigned int> affineExpr;
+
+//exit conditions of a fast-forwardable loop
+enum loopCondition { EXIT_IF_EQUAL, EXIT_IF_NOTEQUAL, EXIT_IF_LESS, EXIT_IF_NOTLESS };
+
+//result of analyzing a hot loop; left and right are the operands of the exit test (compared for
+//equality, or by slt) and each changes by a fixed step every iteration.  next holds the value
+//each changed register takes at the end of an iteration.
+struct LoopPlan {
+    bool valid;
+    unsigned int bodyLength;
+    loopCondition condition;
+    affineExpr left;
+    affineExpr right;
+    unsigned int leftStep;
+    unsigned int rightStep;
+    std::vector<unsigned int> changed;
+    std::vector<affineExpr> next;
+    LoopPlan() : valid(false), bodyLength(0), condition(EXIT_IF_EQUAL), leftStep(0), rightStep(0) {}
+};
+
+//struct to decode instructions; accessed by instructions[i].u.rFormat, etc.
+struct instruction {
+    union   {
+        struct {
+            unsigned int funct:6;
+            unsigned int shamt:5;
+            unsigned int rd:5;
+            unsigned int rt:5;
+            unsigned int rs:5;
+            unsigned int opcode:6;
+        } rFormat;
+        struct  {
+            unsigned int imm:16;
+            unsigned int rt:5;
+            unsigned int rs:5;
+            unsigned int opcode:6;
+        } iFormat;
+        struct  {
+            unsigned int address:26;
+            unsigned int opcode:6;
+        } jFormat;
+        struct  {
+            unsigned int address:26;
+            unsigned int opcode:6;
+        } opcodeCheck;
+        unsigned int encoding;
+    } u;
+};
+
+//a decoded program with its log listing, ready to be simulated any number of times.  If loading
+//failed, error holds the message; listingStarted is set when the failure happened part way through
+//the listing, which is then still written to log.txt.  For an assembled program, sourceLines holds
+//the line in sourceName of each instruction so that runtime messages can point at the source.
+struct Program {
+    std::vector<instruction> instructions;
+    std::vector<int> data;
+    std::vector<std::string> instStorage;
+    std::vector<unsigned int> blockLength;
+    std::string sourceName;
+    std::vector<size_t> sourceLines;
+    std::string listing;
+    std::string error;
+    bool listingStarted;
+    Program() : listingStarted(false) {}
+};
+
+//trace setting and resource limits for one run; a limit of zero means unlimited.  A non-empty
+//batchList runs the program over many inputs instead (see runBatch).
+struct SimOptions {
+    bool traceOn;
+    unsigned long long maxInst;  //retired instructions
+    unsigned long long maxTime;  //wall-clock milliseconds
+    unsigned long long maxLog;   //bytes written to log.txt
+    unsigned long long maxMem;   //guest memory words (instructions plus data)
+    std::string batchList;       //file naming one input file per line
+    size_t lanes;                //inputs run together in lock-step
+    SimOptions() : traceOn(true), maxInst(0), maxTime(0), maxLog(0), maxMem(0), lanes(DEFAULTLANES) {}
+};
+
+//table of register numbers mapped to corresponding name
+const char * const argTable[32] = {
+    "zero", "at", "v0", "v1", "a0", "a1", "a2", "a3",
+    "t0", "t1", "t2", "t3", "t4", "t5", "t6", "t7",
+    "s0", "s1", "s2", "s3", "s4", "s5", "s6", "s7",
+    "t8", "t9", "k0", "k1", "gp", "sp", "fp", "ra"
+};
+
+//tables of opcode values (and funct values for opcode 0) mapped to corresponding mnemonic;
+//unsupported encodings map to a null pointer.  These are built at compile time so that
+//no lookup structures need to be constructed on each run of the simulator.
+const char * const opcodeTable[64] = {
+    0, 0, "j", 0, "beq", "bne", 0, 0, 0, "addiu", 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, "lw", 0, 0, 0, 0, 0, 0, 0, "sw", 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+const char * const functTable[64] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, "syscall", 0, 0, 0,
+    "mfhi", 0, "mflo", 0, 0, 0, 0, 0, "mult", 0, "div", 0, 0, 0, 0, 0,
+    0, "addu", 0, "subu", "and", "or", 0, 0, 0, 0, "slt", 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
 
+void parseOptions(int, char * [], int, SimOptions &);
+bool readSource(const char *, std::string &);
+void loadProgram(const char *, const std::string &, Program &);
+void runProgram(const Program &, const SimOptions &);
+struct BatchLane;
+void runBatch(const Program &, const SimOptions &);
+void printLaneState(const std::vector<int> &, size_t, size_t, int *, size_t, int, std::ofstream &);
+void laneBadPC(const Program &, int, int, BatchLane &, const std::vector<int> &, size_t, size_t, int *);
+void endLane(BatchLane &, int);
+int runServer(int, char * []);
+int runClient(int, char * []);
+std::string sourceNote(const Program &, int);
 void printRegisterState(std::vector<int> &, std::ofstream &);
 void printDataMemory(int *, size_t, std::ofstream &);
+char * formatInt(char *, int, int);
+unsigned long long parseLimit(const char *, const char *);
+bool connectServer(const char *, int &);
+struct ServerRequest;
+bool readRequest(ServerRequest &);
+void closeRequest(ServerRequest &);
+bool sendAll(int, const char *, size_t);
+bool recvAll(int, char *, size_t);
+unsigned long long hashSource(const std::string &);
+void exitOnLimit(const char *, int, int, std::vector<int> &, int *, size_t, std::ofstream &);
+void analyzeLoop(const std::vector<unsigned int> &, int, int, LoopPlan &);
+bool fastForwardLoop(const LoopPlan &, std::vector<int> &, unsigned long long &);
+unsigned int affineEval(const affineExpr &, const std::vector<int> &);
+bool affineStep(const affineExpr &, const std::vector<affineExpr> &, unsigned int &);
+bool isAsmFile(const char *);
+void assembleFile(const char *, std::istream &, std::vector<unsigned int> &, std::vector<int> &,
+                  std::vector<size_t> &);
+void asmError(const char *, size_t, const std::string &);
+unsigned int asmRegister(const char *, size_t, const std::string &);
+int asmNumber(const char *, size_t, const std::string &);
 
 int main(int argc, char * argv[])
 {
@@ -39,117 +227,178 @@ int main(int argc, char * argv[])
         exit(EXIT_FAILURE);
     }
     
-    //open the passed object file for reading
-    std::ifstream inFile(argv[1], std::ios::in);
-    inFile.seekg(std::ios::beg);
+    //server and client modes for running many jobs without restarting the simulator
+    if (strcmp(argv[1], "-serve") == 0)
+        return runServer(argc, argv);
+    if (strcmp(argv[1], "-client") == 0)
+        return runClient(argc, argv);
     
+    SimOptions options;
+    parseOptions(argc, argv, 2, options);
+    
+    Program program;
+    std::string source;
+    if (readSource(argv[1], source))
+        loadProgram(argv[1], source, program);
+    else
+        program.error = "File could not be opened.";
+    
+    runProgram(program, options);
+}
+
+//read the optional trace setting and resource limits from argv[first] onward
+void parseOptions(int argc, char * argv[], int first, SimOptions & options)
+{
+    for (int i = first; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-notrace") == 0)
+        {
+            options.traceOn = false;
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            std::cerr << "Missing value for option " << argv[i] << "\n";
+            exit(EXIT_FAILURE);
+        }
+        if (strcmp(argv[i], "-maxinst") == 0)
+            options.maxInst = parseLimit(argv[i], argv[i + 1]);
+        else if (strcmp(argv[i], "-maxtime") == 0)
+            options.maxTime = parseLimit(argv[i], argv[i + 1]);
+        else if (strcmp(argv[i], "-maxlog") == 0)
+            options.maxLog = parseLimit(argv[i], argv[i + 1]);
+        else if (strcmp(argv[i], "-maxmem") == 0)
+            options.maxMem = parseLimit(argv[i], argv[i + 1]);
+        else if (strcmp(argv[i], "-batch") == 0)
+            options.batchList = argv[i + 1];
+        else if (strcmp(argv[i], "-lanes") == 0)
+        {
+            unsigned long long lanes = parseLimit(argv[i], argv[i + 1]);
+            if (lanes == 0 || lanes > MAXLANES)
+            {
+                std::cerr << "Invalid value " << argv[i + 1] << " for option " << argv[i] << "\n";
+                exit(EXIT_FAILURE);
+            }
+            options.lanes = static_cast<size_t>(lanes);
+        }
+        else
+        {
+            std::cerr << "Unknown option " << argv[i] << "\n";
+            exit(EXIT_FAILURE);
+        }
+        ++i;
+    }
+}
+
+//read the whole program file into memory
+bool readSource(const char * fileName, std::string & source)
+{
+    std::ifstream inFile(fileName, std::ios::in | std::ios::binary);
     if (!inFile)
+        return false;
+    std::ostringstream contents;
+    contents << inFile.rdbuf();
+    source = contents.str();
+    return true;
+}
+
+//Decode a program from the contents of an object or assembly file and build its log listing.
+//Loading never exits the process, so that the server can cache the result; any error is left in
+//program.error and reported when the program is run.
+void loadProgram(const char * fileName, const std::string & source, Program & program)
+{
+    size_t numInst = 0;
+    size_t numWords = 0;
+    
+    //assembled programs are encoded directly into memory rather than read from an object file
+    bool assembleSource = isAsmFile(fileName);
+    std::vector<unsigned int> asmText;
+    std::vector<int> asmData;
+    std::istringstream inFile(source);
+    
+    if (assembleSource)
     {
-        std::cerr << "File could not be opened.\n";
-        exit(EXIT_FAILURE);
+        try
+        {
+            assembleFile(fileName, inFile, asmText, asmData, program.sourceLines);
+        }
+        catch (const std::runtime_error & error)
+        {
+            program.error = error.what();
+            return;
+        }
+        numInst = asmText.size();
+        numWords = asmData.size();
+        program.sourceName = fileName;
+    }
+    else
+    {
+        inFile >> numInst; //read number of instructions
+        inFile >> numWords; //read number of words
     }
     
-    size_t numInst;
-    inFile >> numInst; //read number of instructions
-    size_t numWords;
-    inFile >> numWords; //read number of words
+    //reject programs that do not fit in the instruction or data arrays
+    if (numInst > MAXPROGRAM || numWords > MAXPROGRAM)
+    {
+        program.error = "Program too large: " + std::to_string(numInst) + " instructions, " +
+                        std::to_string(numWords) + " words";
+        return;
+    }
     
+    std::vector<instruction> & instructions = program.instructions;
+    instructions.assign(numInst, instruction());
+    program.data.assign(numWords, 0);
     unsigned int readNum; // used to read hex values
-    unsigned int progInstructions[MAXPROGRAM] = {0};
-    int dataArray[MAXPROGRAM] = {0};
     
-    //read in program instructions
-    for (size_t i = 0; i < numInst; ++i)
+    if (assembleSource)
     {
-        inFile >> std::hex >> progInstructions[i];
+        for (size_t i = 0; i < numInst; ++i)
+        {
+            instructions[i].u.encoding = asmText[i];
+        }
+        for (size_t i = 0; i < numWords; ++i)
+        {
+            program.data[i] = asmData[i];
+        }
     }
-    
-    //read dataArray
-    for (size_t i = 0; i < numWords; ++i)
+    else
     {
-        inFile >> std::hex >> readNum;
-        dataArray[i] = static_cast<int>(readNum);
-    }
-    
-    //Done with file, close
-    inFile.close();
-    
-    //create struct to decode instructions
-    struct {
-        union   {
-            struct {
-                unsigned int funct:6;
-                unsigned int shamt:5;
-                unsigned int rd:5;
-                unsigned int rt:5;
-                unsigned int rs:5;
-                unsigned int opcode:6;
-            } rFormat;
-            struct  {
-                unsigned int imm:16;
-                unsigned int rt:5;
-                unsigned int rs:5;
-                unsigned int opcode:6;
-            } iFormat;
-            struct  {
-                unsigned int address:26;
-                unsigned int opcode:6;
-            } jFormat;
-            struct  {
-                unsigned int address:26;
-                unsigned int opcode:6;
-            } opcodeCheck;
-            unsigned int encoding;
-        } u;
-    } instructions[MAXPROGRAM] = {0}; //accessed by instructions.u.rFormat, etc.
-    
-    //put program instructions into struct to allow parsing of bit field values
-    for (size_t i = 0; i < numInst; ++i)
+        //read program instructions directly into the struct to allow parsing of bit field values
+        for (size_t i = 0; i < numInst; ++i)
+        {
+            inFile >> std::hex >> instructions[i].u.encoding;
+        }
+        
+        //read data words
+        for (size_t i = 0; i < numWords; ++i)
+        {
+            inFile >> std::hex >> readNum;
+            program.data[i] = static_cast<int>(readNum);
+        }
+    }
+    
+    //determine the length of the basic block beginning at each instruction; a block ends at a
+    //branch, jump or syscall.  The instruction limit is charged once per block rather than
+    //once per instruction.
+    std::vector<unsigned int> & blockLength = program.blockLength;
+    blockLength.assign(numInst,1);
+    for (size_t i = numInst; i-- > 0; )
     {
-        instructions[i].u.encoding = progInstructions[i];
-    }
-    
-    //create table of argument values mapped to corresponding string
-    std::map <const unsigned int, const std::string> argTable;
-    argTable.insert(codePair(0,"zero")); argTable.insert(codePair(1,"at")); argTable.insert(codePair(2,"v0"));
-    argTable.insert(codePair(3,"v1")); argTable.insert(codePair(4,"a0")); argTable.insert(codePair(5,"a1"));
-    argTable.insert(codePair(6,"a2")); argTable.insert(codePair(7,"a3")); argTable.insert(codePair(8,"t0"));
-    argTable.insert(codePair(9,"t1")); argTable.insert(codePair(10,"t2")); argTable.insert(codePair(11,"t3"));
-    argTable.insert(codePair(12,"t4")); argTable.insert(codePair(13,"t5")); argTable.insert(codePair(14,"t6"));
-    argTable.insert(codePair(15,"t7")); argTable.insert(codePair(16,"s0")); argTable.insert(codePair(17,"s1"));
-    argTable.insert(codePair(18,"s2")); argTable.insert(codePair(19,"s3")); argTable.insert(codePair(20,"s4"));
-    argTable.insert(codePair(21,"s5")); argTable.insert(codePair(22,"s6")); argTable.insert(codePair(23,"s7"));
-    argTable.insert(codePair(24,"t8")); argTable.insert(codePair(25,"t9")); argTable.insert(codePair(26,"k0"));
-    argTable.insert(codePair(27,"k1")); argTable.insert(codePair(28,"gp")); argTable.insert(codePair(29,"sp"));
-    argTable.insert(codePair(30,"fp")); argTable.insert(codePair(31,"ra"));
-    
-    //create table of opcode values mapped to corresponding string.
-    std::map <const opcodeFunctPair, const std::string> opcodeFunctTable;
-    opcodeFunctTable.insert(codePairFunctTable(opcodeFunctPair(9,0),"addiu"));
-    opcodeFunctTable.insert(codePairFunctTable(opcodeFunctPair(0,33),"addu"));
-    opcodeFunctTable.insert(codePairFunctTable(opcodeFunctPair(0,36),"and"));
-    opcodeFunctTable.insert(codePairFunctTable(opcodeFunctPair(4,0),"beq"));
-    opcodeFunctTable.insert(codePairFunctTable(opcodeFunctPair(5,0),"bne"));
-    opcodeFunctTable.insert(codePairFunctTable(opcodeFunctPair(0,26),"div"));
-    opcodeFunctTable.insert(codePairFunctTable(opcodeFunctPair(2,0),"j"));
-    opcodeFunctTable.insert(codePairFunctTable(opcodeFunctPair(35,0),"lw"));
-    opcodeFunctTable.insert(codePairFunctTable(opcodeFunctPair(0,16),"mfhi"));
-    opcodeFunctTable.insert(codePairFunctTable(opcodeFunctPair(0,18),"mflo"));
-    opcodeFunctTable.insert(codePairFunctTable(opcodeFunctPair(0,24),"mult"));
-    opcodeFunctTable.insert(codePairFunctTable(opcodeFunctPair(0,37),"or"));
-    opcodeFunctTable.insert(codePairFunctTable(opcodeFunctPair(0,42),"slt"));
-    opcodeFunctTable.insert(codePairFunctTable(opcodeFunctPair(0,35),"subu"));
-    opcodeFunctTable.insert(codePairFunctTable(opcodeFunctPair(43,0),"sw"));
-    opcodeFunctTable.insert(codePairFunctTable(opcodeFunctPair(0,12),"syscall"));
+        unsigned int opcode = instructions[i].u.opcodeCheck.opcode;
+        bool blockEnd = (opcode == 2 || opcode == 4 || opcode == 5 ||
+                         (opcode == 0 && instructions[i].u.rFormat.funct == 12));
+        if (!blockEnd && (i + 1) < numInst)
+            blockLength[i] = blockLength[i + 1] + 1;
+    }
     
     /* Part 1 - Instruction reading and parsing */
     
-    //prepare text output file
-    std::ofstream outFile("log.txt",std::ios::out);
-    outFile.seekp(std::ios::beg);
+    //the listing is built in memory and written to log.txt when the program is run
+    std::ostringstream outFile;
     
     //prepare instruction storage vector
-    std::vector<std::string> instStorage (numInst,"");
+    std::vector<std::string> & instStorage = program.instStorage;
+    instStorage.assign(numInst,"");
     
     outFile << "insts:\n";
     
@@ -165,12 +414,13 @@ int main(int argc, char * argv[])
         if (opcode == 0)
         {
             funct = instructions[i].u.rFormat.funct;
-            size_t validOpcodeFunct = opcodeFunctTable.count(opcodeFunctPair(0,funct));
-            if (!validOpcodeFunct)
+            if (functTable[funct] == 0)
             {
-                std::cerr << "could not find inst with opcode " << opcode << " and funct " << funct << "\n";
-                outFile.close();
-                exit(EXIT_FAILURE);
+                program.error = "could not find inst with opcode " + std::to_string(opcode) +
+                                " and funct " + std::to_string(funct);
+                program.listingStarted = true;
+                program.listing = outFile.str();
+                return;
             }
         }
         
@@ -179,7 +429,9 @@ int main(int argc, char * argv[])
     
         
         std::string instString; //string to store instructions
-        instString += opcodeFunctTable[opcodeFunctPair(opcode,funct)];
+        const char * mnemonic = (opcode == 0) ? functTable[funct] : opcodeTable[opcode];
+        if (mnemonic != 0)
+            instString += mnemonic;
         
         //determine sequence to ouput
         //separate by opcode using switch statement
@@ -266,9 +518,10 @@ int main(int argc, char * argv[])
                 instStorage[i] += instString;
                 break;
             default: //program should never get here
-                std::cerr << "Invalid opcode / funct cominbation\n";
-                exit(EXIT_FAILURE);
-                break;
+                program.error = "Invalid opcode / funct cominbation";
+                program.listingStarted = true;
+                program.listing = outFile.str();
+                return;
         }
         outFile << instStorage[i];
         outFile << "\n";
@@ -280,11 +533,58 @@ int main(int argc, char * argv[])
     for (size_t i = 0; i < numWords; ++i)
     {
         outFile << std::setw(4) << std::right;
-        outFile << (i+numInst) << ": " << dataArray[i] << "\n";
+        outFile << (i+numInst) << ": " << program.data[i] << "\n";
     } //end of data display section
     
     outFile << "\n";
     
+    program.listing = outFile.str();
+}
+
+//Simulate a loaded program, writing log.txt in the current directory.  Faults and limits end the
+//process as before.
+void runProgram(const Program & program, const SimOptions & options)
+{
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    
+    if (!program.listingStarted && !program.error.empty())
+    {
+        std::cerr << program.error << "\n";
+        exit(EXIT_FAILURE);
+    }
+    if (!options.batchList.empty() && program.error.empty())
+    {
+        runBatch(program, options);
+        return;
+    }
+    
+    size_t numInst = program.instructions.size();
+    size_t numWords = program.data.size();
+    const std::vector<instruction> & instructions = program.instructions;
+    const std::vector<std::string> & instStorage = program.instStorage;
+    const std::vector<unsigned int> & blockLength = program.blockLength;
+    bool traceOn = options.traceOn;
+    unsigned long long maxInst = options.maxInst;
+    unsigned long long maxTime = options.maxTime;
+    unsigned long long maxLog = options.maxLog;
+    
+    int dataArray[MAXPROGRAM] = {0};
+    for (size_t i = 0; i < numWords; ++i)
+    {
+        dataArray[i] = program.data[i];
+    }
+    
+    //prepare text output file and copy in the instruction and data listing
+    std::ofstream outFile("log.txt",std::ios::out);
+    outFile.seekp(std::ios::beg);
+    outFile << program.listing;
+    
+    if (!program.error.empty()) //an invalid instruction ends the listing
+    {
+        std::cerr << program.error << "\n";
+        outFile.close();
+        exit(EXIT_FAILURE);
+    }
     
     /* Part 2 - MIPS Simulator with logged output */
     
@@ -301,13 +601,75 @@ int main(int argc, char * argv[])
     //registerStore[4] = 50000;
     //registerStore[5] = 100000;
     
+    //a program that does not fit in the guest memory quota is stopped before its first instruction
+    if (options.maxMem != 0 && (numInst + numWords) > options.maxMem)
+    {
+        std::cerr << "memory limit exceeded: program needs " << (numInst + numWords) << " words\n";
+        exitOnLimit("memory limit", EXIT_MEM_LIMIT, progCounter, registerStore, dataArray, numWords, outFile);
+    }
     
     bool exitCondition = (progCounter >= numInst);
     
+    //prepare resource accounting; instBudget is charged a whole block on entry to the block
+    unsigned long long instBudget = (maxInst != 0) ? maxInst : ULLONG_MAX;
+    unsigned int blocksUntilCheck = LIMITCHECKINTERVAL;
+    bool checkLog = (maxLog != 0 && traceOn);
+    bool blockStart = true;
+    
+    //loop fast-forwarding is only done when there is no per-instruction trace to reproduce
+    bool fastForward = !traceOn;
+    std::vector<unsigned int> encodings;
+    std::vector<unsigned int> backEdgeCount;
+    std::vector<LoopPlan> loopPlans;
+    if (fastForward)
+    {
+        for (size_t i = 0; i < numInst; ++i)
+        {
+            encodings.push_back(instructions[i].u.encoding);
+        }
+        backEdgeCount.resize(numInst, 0);
+        loopPlans.resize(numInst);
+    }
+    
     while (!exitCondition)
     {
-        outFile << "PC: " << progCounter << "\n";
+        //charge the next basic block against the resource limits
+        if (blockStart)
+        {
+            if (instBudget < blockLength[progCounter])
+            {
+                std::cerr << "instruction limit reached at PC " << progCounter << sourceNote(program, progCounter) << "\n";
+                exitOnLimit("instruction limit", EXIT_INST_LIMIT, progCounter, registerStore, dataArray, numWords, outFile);
+            }
+            instBudget -= blockLength[progCounter];
+            
+            //the log only grows while tracing, where each instruction writes a full dump, so it is
+            //checked every block then and not at all with -notrace
+            if (checkLog && static_cast<unsigned long long>(outFile.tellp()) >= maxLog)
+            {
+                std::cerr << "log size limit reached at PC " << progCounter << sourceNote(program, progCounter) << "\n";
+                exitOnLimit("log size limit", EXIT_LOG_LIMIT, progCounter, registerStore, dataArray, numWords, outFile);
+            }
+            if (maxTime != 0 && --blocksUntilCheck == 0)
+            {
+                blocksUntilCheck = LIMITCHECKINTERVAL;
+                if (static_cast<unsigned long long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - startTime).count()) >= maxTime)
+                {
+                    std::cerr << "time limit reached at PC " << progCounter << sourceNote(program, progCounter) << "\n";
+                    exitOnLimit("time limit", EXIT_TIME_LIMIT, progCounter, registerStore, dataArray, numWords, outFile);
+                }
+            }
+            blockStart = false;
+        }
+        
+        if (traceOn)
+        {
+            outFile << "PC: " << progCounter << "\n";
+            outFile << "inst: " << instStorage[progCounter] << "\n";
+        }
         
+        int instPC = progCounter; //address of the instruction being executed
         unsigned int opcode = instructions[progCounter].u.opcodeCheck.opcode;
         unsigned int funct = 0;
         unsigned int rd;
@@ -340,7 +702,6 @@ int main(int argc, char * argv[])
                 switch(funct)
                 {
                     case 33: //addu instruction
-                        outFile << "inst: " << instStorage[progCounter] << "\n";
                         rd = instructions[progCounter].u.rFormat.rd;
                         if (rd != 0) //prevent the $zero register from being written to
                         {
@@ -352,7 +713,6 @@ int main(int argc, char * argv[])
                         break;
                     
                     case 36: //and instruction
-                        outFile << "inst: " << instStorage[progCounter] << "\n";
                         rd = instructions[progCounter].u.rFormat.rd;
                         if (rd != 0) //prevent the $zero register from being written to
                         {
@@ -364,7 +724,6 @@ int main(int argc, char * argv[])
                         break;
 
                     case 37: //or instruction
-                        outFile << "inst: " << instStorage[progCounter] << "\n";
                         rd = instructions[progCounter].u.rFormat.rd;
                         if (rd != 0) //prevent the $zero register from being written to
                         {
@@ -376,7 +735,6 @@ int main(int argc, char * argv[])
                         break;
                         
                     case 42: //slt instruction
-                        outFile << "inst: " << instStorage[progCounter] << "\n";
                         rd = instructions[progCounter].u.rFormat.rd;
                         if (rd != 0) //prevent the $zero register from being written to
                         {
@@ -388,7 +746,6 @@ int main(int argc, char * argv[])
                         break;
                         
                     case 35: //subu instruction
-                        outFile << "inst: " << instStorage[progCounter] << "\n";
                         rd = instructions[progCounter].u.rFormat.rd;
                         if (rd != 0) //prevent the $zero register from being written to
                         {
@@ -400,11 +757,10 @@ int main(int argc, char * argv[])
                         break;
                         
                     case 26: //div instruction
-                        outFile << "inst: " << instStorage[progCounter] << "\n";
                         rt = instructions[progCounter].u.rFormat.rt;
                         if (registerStore[rt] == 0) //prevent divide by zero
                         {
-                            std::cerr << "divide by zero for instruction at " << progCounter << "\n";
+                            std::cerr << "divide by zero for instruction at " << progCounter << sourceNote(program, instPC) << "\n";
                             outFile.close();
                             exit(EXIT_FAILURE);
                         }
@@ -415,7 +771,6 @@ int main(int argc, char * argv[])
                         break;
                         
                     case 24: // mult instruction
-                        outFile << "inst: " << instStorage[progCounter] << "\n";
                         rt = instructions[progCounter].u.rFormat.rt;
                         rs = instructions[progCounter].u.rFormat.rs;
                         longAssist.u.fullLong.full = static_cast<long>(registerStore[rs]) *
@@ -426,7 +781,6 @@ int main(int argc, char * argv[])
                         break;
                         
                     case 12: //syscall case - v0 is either 1, 5; otherwise ignore and exit condition is tested later
-                        outFile << "inst: " << instStorage[progCounter] << "\n";
                         if (registerStore[2] == 1)
                         {
                             std::cout << registerStore[4] << "\n";
@@ -439,7 +793,6 @@ int main(int argc, char * argv[])
                         break;
                         
                     case 16: //mfhi instruction - move hi register to rd
-                        outFile << "inst: " << instStorage[progCounter] << "\n";
                         rd = instructions[progCounter].u.rFormat.rd;
                         if (rd != 0) //prevent the zero register from being written to
                         {
@@ -449,7 +802,6 @@ int main(int argc, char * argv[])
                         break;
                 
                     case 18: //mflo instuction - move lo register to rd
-                        outFile << "inst: " << instStorage[progCounter] << "\n";
                         rd = instructions[progCounter].u.rFormat.rd;
                         if (rd != 0) //prevent the zero register from being written to
                         {
@@ -467,7 +819,6 @@ int main(int argc, char * argv[])
                 break; //case if opcode 0
                 
             case 9: //addiu instruction
-                outFile << "inst: " << instStorage[progCounter] << "\n";
                 rt = instructions[progCounter].u.iFormat.rt;
                 if (rt != 0) //prevent the zero register from being written to
                 {
@@ -492,8 +843,7 @@ int main(int argc, char * argv[])
                         //check if PC is accessing data memory
                         if ((progCounter + immSigned) <= (numInst + numWords - 1))
                         {
-                            std::cerr << "PC is accessing data memory at address " << (progCounter + immSigned) << "\n";
-                            outFile << "inst: " << instStorage[progCounter] << "\n";
+                            std::cerr << "PC is accessing data memory at address " << (progCounter + immSigned) << sourceNote(program, instPC) << "\n";
                             printRegisterState(registerStore,outFile);
                             outFile << "\n\n";
                             printDataMemory(dataArray,numWords,outFile);
@@ -504,8 +854,7 @@ int main(int argc, char * argv[])
                         }
                         else
                         {
-                            std::cerr << "PC is accessing illegal memory address " << (progCounter + immSigned) << "\n";
-                            outFile << "inst: " << instStorage[progCounter] << "\n";
+                            std::cerr << "PC is accessing illegal memory address " << (progCounter + immSigned) << sourceNote(program, instPC) << "\n";
                             printRegisterState(registerStore,outFile);
                             outFile << "\n\n";
                             printDataMemory(dataArray,numWords,outFile);
@@ -516,12 +865,10 @@ int main(int argc, char * argv[])
                         outFile.close();
                         exit(EXIT_FAILURE);
                     }
-                    outFile << "inst: " << instStorage[progCounter] << "\n";
                     progCounter += immSigned;
                 }
                 else
                 {
-                    outFile << "inst: " << instStorage[progCounter] << "\n";
                     ++progCounter;
                 }
                 break;
@@ -539,8 +886,7 @@ int main(int argc, char * argv[])
                         //check if PC is accessing data memory
                         if ((progCounter + immSigned) <= (numInst + numWords - 1))
                         {
-                            std::cerr << "PC is accessing data memory at address " << (progCounter + immSigned) << "\n";
-                            outFile << "inst: " << instStorage[progCounter] << "\n";
+                            std::cerr << "PC is accessing data memory at address " << (progCounter + immSigned) << sourceNote(program, instPC) << "\n";
                             printRegisterState(registerStore,outFile);
                             outFile << "\n\n";
                             printDataMemory(dataArray,numWords,outFile);
@@ -550,8 +896,7 @@ int main(int argc, char * argv[])
                         }
                         else
                         {
-                            std::cerr << "PC is accessing illegal memory address " << (progCounter + immSigned) << "\n";
-                            outFile << "inst: " << instStorage[progCounter] << "\n";
+                            std::cerr << "PC is accessing illegal memory address " << (progCounter + immSigned) << sourceNote(program, instPC) << "\n";
                             printRegisterState(registerStore,outFile);
                             outFile << "\n\n";
                             printDataMemory(dataArray,numWords,outFile);
@@ -562,12 +907,10 @@ int main(int argc, char * argv[])
                         outFile.close();
                         exit(EXIT_FAILURE);
                     }
-                    outFile << "inst: " << instStorage[progCounter] << "\n";
                     progCounter += immSigned;
                 }
                 else
                 {
-                    outFile << "inst: " << instStorage[progCounter] << "\n";
                     ++progCounter;
                 }
                 break;
@@ -581,8 +924,7 @@ int main(int argc, char * argv[])
                     //check if PC is accessing data memory
                     if ( address < (numInst + numWords) )
                     {
-                        std::cerr << "PC is accessing data memory at address " << addressSigned << "\n";
-                        outFile << "inst: " << instStorage[progCounter] << "\n";
+                        std::cerr << "PC is accessing data memory at address " << addressSigned << sourceNote(program, instPC) << "\n";
                         printRegisterState(registerStore,outFile);
                         outFile << "\n\n";
                         printDataMemory(dataArray,numWords,outFile);
@@ -592,8 +934,7 @@ int main(int argc, char * argv[])
                     }
                     else
                     {
-                        std::cerr << "PC is accessing illegal memory address " << addressSigned << "\n";
-                        outFile << "inst: " << instStorage[progCounter] << "\n";
+                        std::cerr << "PC is accessing illegal memory address " << addressSigned << sourceNote(program, instPC) << "\n";
                         printRegisterState(registerStore,outFile);
                         outFile << "\n\n";
                         printDataMemory(dataArray,numWords,outFile);
@@ -604,12 +945,10 @@ int main(int argc, char * argv[])
                     outFile.close();
                     exit(EXIT_FAILURE);
                 }
-                outFile << "inst: " << instStorage[progCounter] << "\n";
                 progCounter = addressSigned;
                 break;
     
             case 35: //lw instruction
-                outFile << "inst: " << instStorage[progCounter] << "\n";
                 imm = instructions[progCounter].u.iFormat.imm;
                 immSigned = static_cast<short>(imm);
                 rt = instructions[progCounter].u.iFormat.rt; //destination
@@ -619,13 +958,13 @@ int main(int argc, char * argv[])
                 //first check to ensure load address is valid
                 if ((addrLoadStore < numInst) && addrLoadStore >= 0)
                 {
-                    std::cerr << "load from instruction memory at address " << addrLoadStore << "\n";
+                    std::cerr << "load from instruction memory at address " << addrLoadStore << sourceNote(program, instPC) << "\n";
                     outFile.close();
                     exit(EXIT_FAILURE);
                 }
                 if ((addrLoadStore < (numInst)) || (addrLoadStore >= (numInst + numWords)))
                 {
-                    std::cerr << "load outside of data memory at address " << addrLoadStore << "\n";
+                    std::cerr << "load outside of data memory at address " << addrLoadStore << sourceNote(program, instPC) << "\n";
                     outFile.close();
                     exit(EXIT_FAILURE);
                 }
@@ -637,7 +976,6 @@ int main(int argc, char * argv[])
                 break;
                 
             case 43: //sw instruction  sw $s0,0($gp)
-                outFile << "inst: " << instStorage[progCounter] << "\n";
                 imm = instructions[progCounter].u.iFormat.imm;
                 immSigned = static_cast<short>(imm);
                 rt = instructions[progCounter].u.iFormat.rt; //where word is to be taken from
@@ -647,13 +985,13 @@ int main(int argc, char * argv[])
                 //first check to ensure load address is valid
                 if ((addrLoadStore < numInst) && addrLoadStore >= 0)
                 {
-                    std::cerr << "store to instruction memory at address " << addrLoadStore << "\n";
+                    std::cerr << "store to instruction memory at address " << addrLoadStore << sourceNote(program, instPC) << "\n";
                     outFile.close();
                     exit(EXIT_FAILURE);
                 }
                 if ((addrLoadStore < (numInst)) || (addrLoadStore >= (numInst + numWords)))
                 {
-                    std::cerr << "store outside of data memory at address " << addrLoadStore << "\n";
+                    std::cerr << "store outside of data memory at address " << addrLoadStore << sourceNote(program, instPC) << "\n";
                     outFile.close();
                     exit(EXIT_FAILURE);
                 }
@@ -675,16 +1013,19 @@ int main(int argc, char * argv[])
         vzero = registerStore[2];
         exitCondition = (opcode == 0 && funct == 12 && vzero == 10); // || (progCounter >= numInst);
         
+        //a branch, jump or syscall ends the current basic block
+        blockStart = (opcode == 2 || opcode == 4 || opcode == 5 || (opcode == 0 && funct == 12));
+        
         //if current ProgCounter is higher than inst number
         if ((progCounter) >= numInst && (!exitCondition))
         {
             if ((progCounter) < (numInst + numWords))
             {
-                std::cerr << "PC is accessing data memory at address " << (progCounter) << "\n";
+                std::cerr << "PC is accessing data memory at address " << (progCounter) << sourceNote(program, instPC) << "\n";
             }
             else
             {
-                std::cerr << "PC is accessing illegal memory address " << (progCounter) << "\n";
+                std::cerr << "PC is accessing illegal memory address " << (progCounter) << sourceNote(program, instPC) << "\n";
             }
             printRegisterState(registerStore,outFile);
             outFile << "\n\n";
@@ -695,7 +1036,20 @@ int main(int argc, char * argv[])
             exit(EXIT_FAILURE); //exit program due to PC access failure
         }
         
-        if (!exitCondition)
+        //a backward branch or jump closes a loop; once hot, try to skip the remaining iterations
+        if (fastForward && blockStart && progCounter <= instPC && !exitCondition)
+        {
+            if (backEdgeCount[instPC] < HOTLOOPTHRESHOLD && ++backEdgeCount[instPC] == HOTLOOPTHRESHOLD)
+            {
+                analyzeLoop(encodings, progCounter, instPC, loopPlans[instPC]);
+            }
+            if (backEdgeCount[instPC] == HOTLOOPTHRESHOLD && loopPlans[instPC].valid)
+            {
+                fastForwardLoop(loopPlans[instPC], registerStore, instBudget);
+            }
+        }
+        
+        if (traceOn && !exitCondition)
         {
             printRegisterState(registerStore,outFile);
             outFile << "\n\n";
@@ -709,82 +1063,1695 @@ int main(int argc, char * argv[])
     outFile.close();
 }
 
-void printRegisterState(std::vector<int> & registerStore, std::ofstream & outFile)
-{
-    outFile << std::left << "\nregs:\n";
-    outFile << std::right;
-    outFile << std::setw(10) << "$zero =" << std::setw(6) << registerStore[0];
-    outFile << std::setw(10) << "$at =" << std::setw(6) << registerStore[1];
-    outFile << std::setw(10) << "$v0 =" << std::setw(6) << registerStore[2];
-    outFile << std::setw(10) << "$v1 =" << std::setw(6) << registerStore[3] << "\n";
-    outFile << std::setw(10) << "$a0 =" << std::setw(6) << registerStore[4];
-    outFile << std::setw(10) << "$a1 =" << std::setw(6) << registerStore[5];
-    outFile << std::setw(10) << "$a2 =" << std::setw(6) << registerStore[6];
-    outFile << std::setw(10) << "$a3 =" << std::setw(6) << registerStore[7] << "\n";
-    outFile << std::setw(10) << "$t0 =" << std::setw(6) << registerStore[8];
-    outFile << std::setw(10) << "$t1 =" << std::setw(6) << registerStore[9];
-    outFile << std::setw(10) << "$t2 =" << std::setw(6) << registerStore[10];
-    outFile << std::setw(10) << "$t3 =" << std::setw(6) << registerStore[11] << "\n";
-    outFile << std::setw(10) << "$t4 =" << std::setw(6) << registerStore[12];
-    outFile << std::setw(10) << "$t5 =" << std::setw(6) << registerStore[13];
-    outFile << std::setw(10) << "$t6 =" << std::setw(6) << registerStore[14];
-    outFile << std::setw(10) << "$t7 =" << std::setw(6) << registerStore[15] << "\n";
-    outFile << std::setw(10) << "$s0 =" << std::setw(6) << registerStore[16];
-    outFile << std::setw(10) << "$s1 =" << std::setw(6) << registerStore[17];
-    outFile << std::setw(10) << "$s2 =" << std::setw(6) << registerStore[18];
-    outFile << std::setw(10) << "$s3 =" << std::setw(6) << registerStore[19] << "\n";
-    outFile << std::setw(10) << "$s4 =" << std::setw(6) << registerStore[20];
-    outFile << std::setw(10) << "$s5 =" << std::setw(6) << registerStore[21];
-    outFile << std::setw(10) << "$s6 =" << std::setw(6) << registerStore[22];
-    outFile << std::setw(10) << "$s7 =" << std::setw(6) << registerStore[23] << "\n";
-    outFile << std::setw(10) << "$t8 =" << std::setw(6) << registerStore[24];
-    outFile << std::setw(10) << "$t9 =" << std::setw(6) << registerStore[25];
-    outFile << std::setw(10) << "$k0 =" << std::setw(6) << registerStore[26];
-    outFile << std::setw(10) << "$k1 =" << std::setw(6) << registerStore[27] << "\n";
-    outFile << std::setw(10) << "$gp =" << std::setw(6) << registerStore[28];
-    outFile << std::setw(10) << "$sp =" << std::setw(6) << registerStore[29];
-    outFile << std::setw(10) << "$fp =" << std::setw(6) << registerStore[30];
-    outFile << std::setw(10) << "$ra =" << std::setw(6) << registerStore[31] << "\n";
-    outFile << std::setw(10) << "$lo =" << std::setw(6) << registerStore[32];
-    outFile << std::setw(10) << "$hi =" << std::setw(6) << registerStore[33];
-}
+/*
+Batch mode.  "sim.exe <file> -notrace -batch <list> [-lanes k]" runs the program once for every
+input file named in <list> (one per line), k lanes at a time in lock-step.  For an input file X the
+run's standard output, standard error, log and exit status are written to X.out, X.err, X.log and
+X.status, exactly as "sim.exe <file> -notrace [limits] < X" would produce them.
 
-void printDataMemory(int * dataArray, size_t numWords, std::ofstream & outFile)
+The register file is kept as structure-of-arrays, regs[register * width + lane], and each
+instruction is issued once for the group of lanes sharing the lowest PC, with mask selecting them.
+Register arithmetic is done across the whole group with branch-free masked loops, while syscalls,
+loads, stores and faults are handled lane by lane.  Lanes that take different sides of a branch
+wait until the group with the lower PC catches up with them; since there are no calls, that is the
+same point at which a post-dominator stack would reconverge them in ordinary loops and ifs.
+*/
+
+//one lane of a batch run: its input vector, the files standing in for stdout, stderr and log.txt,
+//its instruction budget, and its PC while it waits outside the issuing group
+struct BatchLane {
+    std::string name;
+    std::ifstream input;
+    std::ofstream output;
+    std::ofstream errors;
+    std::ofstream log;
+    unsigned long long instBudget;
+    int progCounter;
+    bool running;
+    bool blockStart;
+    BatchLane() : instBudget(0), progCounter(0), running(false), blockStart(false) {}
+};
+
+void runBatch(const Program & program, const SimOptions & options)
 {
-    outFile << std::left << "data memory:\n";
-    outFile << std::right;
+    if (options.traceOn)
+    {
+        std::cerr << "-batch requires -notrace\n";
+        exit(EXIT_FAILURE);
+    }
+    std::ifstream listFile(options.batchList.c_str());
+    if (!listFile)
+    {
+        std::cerr << "Could not open input list " << options.batchList << "\n";
+        exit(EXIT_FAILURE);
+    }
+    std::vector<std::string> inputs;
+    std::string line;
+    while (std::getline(listFile, line))
+    {
+        line.erase(0, line.find_first_not_of(" \t\r"));
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+        if (!line.empty())
+            inputs.push_back(line);
+    }
     
-    for (size_t i = 0; i < numWords; ++i)
+    size_t numInst = program.instructions.size();
+    size_t numWords = program.data.size();
+    const std::vector<instruction> & instructions = program.instructions;
+    const std::vector<unsigned int> & blockLength = program.blockLength;
+    unsigned long long maxInst = options.maxInst;
+    unsigned long long maxTime = options.maxTime;
+    bool accounting = (maxInst != 0 || maxTime != 0);
+    size_t width = options.lanes;
+    int batchStatus = EXIT_SUCCESS;
+    
+    std::vector<BatchLane> lanes(width);
+    std::vector<int> regs(34 * width);
+    std::vector<int> laneData(numWords * width);
+    std::vector<int> mask(width); //-1 for the lanes issuing the current instruction, otherwise 0
+    
+    for (size_t first = 0; first < inputs.size(); first += width)
     {
-        if ((i != 0) && (i % 3) == 0)
+        std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+        size_t running = 0;
+        std::fill(regs.begin(), regs.end(), 0);
+        for (size_t l = 0; l < width; ++l)
         {
-            outFile << "\n";
+            BatchLane & lane = lanes[l];
+            lane.running = false;
+            mask[l] = 0;
+            if (first + l >= inputs.size())
+                continue;
+            
+            lane.name = inputs[first + l];
+            lane.input.clear();
+            lane.input.open(lane.name.c_str());
+            if (!lane.input)
+            {
+                std::cerr << "Could not open input file " << lane.name << "\n";
+                batchStatus = EXIT_FAILURE;
+                continue;
+            }
+            lane.output.clear();
+            lane.output.open((lane.name + ".out").c_str());
+            lane.errors.clear();
+            lane.errors.open((lane.name + ".err").c_str());
+            lane.log.clear();
+            lane.log.open((lane.name + ".log").c_str());
+            lane.log << program.listing;
+            
+            regs[28 * width + l] = static_cast<int>(numInst); //$gp
+            for (size_t i = 0; i < numWords; ++i)
+                laneData[l * numWords + i] = program.data[i];
+            lane.instBudget = (maxInst != 0) ? maxInst : ULLONG_MAX;
+            lane.progCounter = 0;
+            lane.blockStart = true;
+            lane.running = true;
+            ++running;
+            
+            if (options.maxMem != 0 && (numInst + numWords) > options.maxMem)
+            {
+                lane.errors << "memory limit exceeded: program needs " << (numInst + numWords) << " words\n";
+                printLaneState(regs, l, width, laneData.data(), numWords, 0, lane.log);
+                lane.log << "memory limit reached\n";
+                endLane(lane, EXIT_MEM_LIMIT);
+                --running;
+            }
+            else if (numInst == 0)
+            {
+                lane.log << "exiting simulator\n";
+                endLane(lane, EXIT_SUCCESS);
+                --running;
+            }
         }
-        outFile << std::setw(8) << "data[";
-        outFile << std::setw(3) << i;
-        outFile << "] =";
-        outFile << std::setw(6) << dataArray[i];
         
-    }
-    outFile << "\n";
-}
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
+        int groupPC = 0;          //PC of every lane in the issuing group
+        size_t groupSize = 0;
+        int waitingMin = INT_MAX; //lowest PC among the running lanes outside the group
+        bool regroup = true;
+        bool blockPending = false;
+        unsigned int blocksUntilCheck = LIMITCHECKINTERVAL;
+        
+        while (running > 0)
+        {
+            //issue from the lanes with the lowest PC
+            if (regroup)
+            {
+                groupPC = INT_MAX;
+                for (size_t l = 0; l < width; ++l)
+                {
+                    if (lanes[l].running && lanes[l].progCounter < groupPC)
+                        groupPC = lanes[l].progCounter;
+                }
+                groupSize = 0;
+                waitingMin = INT_MAX;
+                for (size_t l = 0; l < width; ++l)
+                {
+                    mask[l] = (lanes[l].running && lanes[l].progCounter == groupPC) ? -1 : 0;
+                    if (mask[l])
+                    {
+                        ++groupSize;
+                        blockPending = blockPending || lanes[l].blockStart;
+                    }
+                    else if (lanes[l].running && lanes[l].progCounter < waitingMin)
+                    {
+                        waitingMin = lanes[l].progCounter;
+                    }
+                }
+                regroup = false;
+            }
+            
+            //charge each lane entering a basic block against its limits, as runProgram does
+            if (accounting && blockPending)
+            {
+                blockPending = false;
+                bool timeUp = false;
+                if (maxTime != 0 && --blocksUntilCheck == 0)
+                {
+                    blocksUntilCheck = LIMITCHECKINTERVAL;
+                    timeUp = (static_cast<unsigned long long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                  std::chrono::steady_clock::now() - startTime).count()) >= maxTime);
+                }
+                for (size_t l = 0; l < width; ++l)
+                {
+                    BatchLane & lane = lanes[l];
+                    if (!mask[l] || !lane.blockStart)
+                        continue;
+                    lane.blockStart = false;
+                    const char * reason = 0;
+                    int status = 0;
+                    if (lane.instBudget < blockLength[groupPC])
+                    {
+                        reason = "instruction limit";
+                        status = EXIT_INST_LIMIT;
+                    }
+                    else
+                    {
+                        lane.instBudget -= blockLength[groupPC];
+                        if (timeUp)
+                        {
+                            reason = "time limit";
+                            status = EXIT_TIME_LIMIT;
+                        }
+                    }
+                    if (reason != 0)
+                    {
+                        lane.errors << reason << " reached at PC " << groupPC << sourceNote(program, groupPC) << "\n";
+                        printLaneState(regs, l, width, laneData.data(), numWords, groupPC, lane.log);
+                        lane.log << reason << " reached\n";
+                        endLane(lane, status);
+                        mask[l] = 0;
+                        --groupSize;
+                        --running;
+                    }
+                }
+                if (groupSize == 0)
+                {
+                    regroup = true;
+                    continue;
+                }
+            }
+            
+            const instruction & inst = instructions[groupPC];
+            unsigned int opcode = inst.u.opcodeCheck.opcode;
+            unsigned int funct = (opcode == 0) ? inst.u.rFormat.funct : 0;
+            int * m = &mask[0];
+            int nextPC = groupPC + 1;
+            bool blockEnd = false;
+            bool diverged = false;
+            
+            if (opcode == 0 && (funct == 33 || funct == 35 || funct == 36 || funct == 37 || funct == 42 ||
+                                funct == 16 || funct == 18))
+            {
+                //register arithmetic on the whole group: d = m ? result : d
+                unsigned int rd = inst.u.rFormat.rd;
+                if (rd != 0) //prevent the $zero register from being written to
+                {
+                    int * d = &regs[rd * width];
+                    const int * a = &regs[inst.u.rFormat.rs * width];
+                    const int * b = &regs[inst.u.rFormat.rt * width];
+                    const int * lo = &regs[32 * width];
+                    const int * hi = &regs[33 * width];
+                    switch (funct)
+                    {
+                        case 33: //addu
+                            for (size_t l = 0; l < width; ++l)
+                                d[l] = (d[l] & ~m[l]) | (static_cast<int>(static_cast<unsigned int>(a[l]) + static_cast<unsigned int>(b[l])) & m[l]);
+                            break;
+                        case 35: //subu
+                            for (size_t l = 0; l < width; ++l)
+                                d[l] = (d[l] & ~m[l]) | (static_cast<int>(static_cast<unsigned int>(a[l]) - static_cast<unsigned int>(b[l])) & m[l]);
+                            break;
+                        case 36: //and
+                            for (size_t l = 0; l < width; ++l)
+                                d[l] = (d[l] & ~m[l]) | (a[l] & b[l] & m[l]);
+                            break;
+                        case 37: //or
+                            for (size_t l = 0; l < width; ++l)
+                                d[l] = (d[l] & ~m[l]) | ((a[l] | b[l]) & m[l]);
+                            break;
+                        case 42: //slt
+                            for (size_t l = 0; l < width; ++l)
+                                d[l] = (d[l] & ~m[l]) | (static_cast<int>(a[l] < b[l]) & m[l]);
+                            break;
+                        case 16: //mfhi
+                            for (size_t l = 0; l < width; ++l)
+                                d[l] = (d[l] & ~m[l]) | (hi[l] & m[l]);
+                            break;
+                        case 18: //mflo
+                            for (size_t l = 0; l < width; ++l)
+                                d[l] = (d[l] & ~m[l]) | (lo[l] & m[l]);
+                            break;
+                    }
+                }
+            }
+            else if (opcode == 0 && funct == 24) //mult
+            {
+                const int * a = &regs[inst.u.rFormat.rs * width];
+                const int * b = &regs[inst.u.rFormat.rt * width];
+                int * lo = &regs[32 * width];
+                int * hi = &regs[33 * width];
+                for (size_t l = 0; l < width; ++l)
+                {
+                    long long product = static_cast<long long>(a[l]) * static_cast<long long>(b[l]);
+                    lo[l] = (lo[l] & ~m[l]) | (static_cast<int>(product) & m[l]);
+                    hi[l] = (hi[l] & ~m[l]) | (static_cast<int>(product >> 32) & m[l]);
+                }
+            }
+            else if (opcode == 9) //addiu
+            {
+                unsigned int rt = inst.u.iFormat.rt;
+                if (rt != 0) //prevent the zero register from being written to
+                {
+                    int * d = &regs[rt * width];
+                    const int * a = &regs[inst.u.iFormat.rs * width];
+                    unsigned int immSigned = static_cast<unsigned int>(static_cast<short>(inst.u.iFormat.imm));
+                    for (size_t l = 0; l < width; ++l)
+                        d[l] = (d[l] & ~m[l]) | (static_cast<int>(static_cast<unsigned int>(a[l]) + immSigned) & m[l]);
+                }
+            }
+            else if (opcode == 4 || opcode == 5) //beq, bne
+            {
+                blockEnd = true;
+                const int * a = &regs[inst.u.iFormat.rs * width];
+                const int * b = &regs[inst.u.iFormat.rt * width];
+                int target = groupPC + static_cast<short>(inst.u.iFormat.imm);
+                size_t taken = 0;
+                for (size_t l = 0; l < width; ++l)
+                {
+                    if (!m[l] || ((a[l] == b[l]) != (opcode == 4)))
+                        continue;
+                    if (target < 0 || static_cast<size_t>(target) >= numInst)
+                    {
+                        laneBadPC(program, groupPC, target, lanes[l], regs, l, width, laneData.data());
+                        m[l] = 0;
+                        --groupSize;
+                        --running;
+                    }
+                    else
+                    {
+                        ++taken;
+                    }
+                }
+                if (taken == groupSize)
+                {
+                    nextPC = target;
+                }
+                else if (taken != 0)
+                {
+                    //the group splits; each lane keeps its own PC until the next regroup
+                    diverged = true;
+                    for (size_t l = 0; l < width; ++l)
+                    {
+                        if (m[l])
+                            lanes[l].progCounter = ((a[l] == b[l]) == (opcode == 4)) ? target : groupPC + 1;
+                    }
+                }
+            }
+            else if (opcode == 2) //j
+            {
+                blockEnd = true;
+                nextPC = static_cast<int>(inst.u.jFormat.address);
+                if (static_cast<size_t>(nextPC) >= numInst)
+                {
+                    for (size_t l = 0; l < width; ++l)
+                    {
+                        if (m[l])
+                        {
+                            laneBadPC(program, groupPC, nextPC, lanes[l], regs, l, width, laneData.data());
+                            m[l] = 0;
+                            --running;
+                        }
+                    }
+                    groupSize = 0;
+                }
+            }
+            else //syscall, div, lw and sw are done one lane at a time
+            {
+                blockEnd = (opcode == 0 && funct == 12);
+                for (size_t l = 0; l < width; ++l)
+                {
+                    if (!m[l])
+                        continue;
+                    BatchLane & lane = lanes[l];
+                    std::string fault;
+                    if (opcode == 0 && funct == 12) //syscall
+                    {
+                        int & vzero = regs[2 * width + l];
+                        if (vzero == 1)
+                            lane.output << regs[4 * width + l] << "\n";
+                        if (vzero == 5)
+                            lane.input >> vzero;
+                        if (vzero == 10)
+                        {
+                            lane.log << "exiting simulator\n";
+                            endLane(lane, EXIT_SUCCESS);
+                            m[l] = 0;
+                            --groupSize;
+                            --running;
+                        }
+                    }
+                    else if (opcode == 0) //div
+                    {
+                        int dividend = regs[inst.u.rFormat.rs * width + l];
+                        int divisor = regs[inst.u.rFormat.rt * width + l];
+                        if (divisor == 0) //prevent divide by zero
+                        {
+                            fault = "divide by zero for instruction at " + std::to_string(groupPC);
+                        }
+                        else if (divisor == -1) //INT_MIN / -1 would trap
+                        {
+                            regs[32 * width + l] = static_cast<int>(0u - static_cast<unsigned int>(dividend));
+                            regs[33 * width + l] = 0;
+                        }
+                        else
+                        {
+                            regs[32 * width + l] = dividend / divisor; //put quotient in lo
+                            regs[33 * width + l] = dividend % divisor; //put remainder in hi
+                        }
+                    }
+                    else //lw, sw
+                    {
+                        int address = static_cast<int>(static_cast<unsigned int>(regs[inst.u.iFormat.rs * width + l]) +
+                                                       static_cast<unsigned int>(static_cast<short>(inst.u.iFormat.imm)));
+                        const char * access = (opcode == 35) ? "load" : "store";
+                        if (address >= 0 && static_cast<size_t>(address) < numInst)
+                        {
+                            fault = std::string(access) + ((opcode == 35) ? " from" : " to") +
+                                    " instruction memory at address " + std::to_string(address);
+                        }
+                        else if (address < 0 || static_cast<size_t>(address) >= numInst + numWords)
+                        {
+                            fault = std::string(access) + " outside of data memory at address " + std::to_string(address);
+                        }
+                        else if (opcode == 35)
+                        {
+                            if (inst.u.iFormat.rt != 0) //prevent zero register from being written to
+                                regs[inst.u.iFormat.rt * width + l] = laneData[l * numWords + address - numInst];
+                        }
+                        else
+                        {
+                            laneData[l * numWords + address - numInst] = regs[inst.u.iFormat.rt * width + l];
+                        }
+                    }
+                    if (!fault.empty())
+                    {
+                        lane.errors << fault << sourceNote(program, groupPC) << "\n";
+                        endLane(lane, EXIT_FAILURE);
+                        m[l] = 0;
+                        --groupSize;
+                        --running;
+                    }
+                }
+            }
+            
+            //a branch, jump or syscall ends the current basic block
+            if (blockEnd)
+            {
+                for (size_t l = 0; l < width; ++l)
+                {
+                    if (m[l])
+                        lanes[l].blockStart = true;
+                }
+                blockPending = true;
+            }
+            
+            //lanes falling off the end of the instruction memory fault as in runProgram
+            for (size_t l = 0; (diverged || static_cast<size_t>(nextPC) >= numInst) && l < width; ++l)
+            {
+                int lanePC = diverged ? lanes[l].progCounter : nextPC;
+                if (m[l] && static_cast<size_t>(lanePC) >= numInst)
+                {
+                    laneBadPC(program, groupPC, lanePC, lanes[l], regs, l, width, laneData.data());
+                    m[l] = 0;
+                    --groupSize;
+                    --running;
+                }
+            }
+            
+            groupPC = nextPC;
+            if (diverged || groupSize == 0 || groupPC >= waitingMin)
+            {
+                for (size_t l = 0; !diverged && l < width; ++l)
+                {
+                    if (m[l])
+                        lanes[l].progCounter = groupPC;
+                }
+                regroup = true;
+            }
+        }
+    }
+    
+    exit(batchStatus);
+}
+
+//write the lane's registers, data memory and PC to its log in the form used by runProgram
+void printLaneState(const std::vector<int> & regs, size_t lane, size_t width, int * laneData, size_t numWords,
+                    int progCounter, std::ofstream & outFile)
+{
+    std::vector<int> registerStore(34);
+    for (size_t r = 0; r < 34; ++r)
+        registerStore[r] = regs[r * width + lane];
+    printRegisterState(registerStore,outFile);
+    outFile << "\n\n";
+    printDataMemory(laneData + lane * numWords,numWords,outFile);
+    outFile << "\n\n";
+    outFile << "PC: " << progCounter << "\n";
+}
+
+//end a lane whose branch, jump or fall-through took the PC out of the instruction memory
+void laneBadPC(const Program & program, int instPC, int target, BatchLane & lane, const std::vector<int> & regs,
+               size_t l, size_t width, int * laneData)
+{
+    size_t numInst = program.instructions.size();
+    size_t numWords = program.data.size();
+    if (target >= 0 && static_cast<size_t>(target) < numInst + numWords)
+        lane.errors << "PC is accessing data memory at address " << target << sourceNote(program, instPC) << "\n";
+    else
+        lane.errors << "PC is accessing illegal memory address " << target << sourceNote(program, instPC) << "\n";
+    printLaneState(regs, l, width, laneData, numWords, target, lane.log);
+    endLane(lane, EXIT_FAILURE);
+}
+
+//close a finished lane's files and record its exit status in X.status
+void endLane(BatchLane & lane, int status)
+{
+    lane.input.close();
+    lane.output.close();
+    lane.errors.close();
+    lane.log.close();
+    std::ofstream statusFile((lane.name + ".status").c_str());
+    statusFile << status << "\n";
+    lane.running = false;
+}
+
+/*
+Simulation server.  "sim.exe -serve <socket> [-workers n] [-cache n]" listens on a Unix domain
+socket and "sim.exe -client <socket> <file> [options]" runs one job through it, behaving like
+"sim.exe <file> [options]": the client passes its stdin, stdout and stderr along with its working
+directory, so guest I/O, error messages and log.txt all land exactly where a local run puts them,
+and the client exits with the job's exit status.
+
+The server keeps decoded programs (instructions, data, listing and block lengths) in an LRU cache
+keyed by a hash of the file contents, and runs each job in a forked child so that the interpreter's
+exit() on faults and limits ends only that job.  At most "workers" jobs run at once; further
+requests wait their turn.  Connections are non-blocking and read as their data arrives, so a slow
+or idle client holds up nobody else.
+
+A request is a 4-byte length followed by NUL-terminated strings (working directory, program file,
+options), sent with the three descriptors attached; the reply is the 4-byte exit status.
+*/
+
+//a client connection whose request is still arriving or is waiting for a free worker
+struct ServerRequest {
+    int connFd;
+    int clientFds[3];
+    std::string data;
+    std::vector<std::string> fields;
+    ServerRequest() : connFd(-1) { clientFds[0] = clientFds[1] = clientFds[2] = -1; }
+};
+
+//write end of the pipe used to wake the server's poll() when a job finishes
+static int childPipe[2] = {-1, -1};
+
+static void onChildExit(int)
+{
+    int savedErrno = errno;
+    char byte = 0;
+    if (write(childPipe[1], &byte, 1) < 0) {} //a full pipe already has a wakeup pending
+    errno = savedErrno;
+}
+
+int runServer(int argc, char * argv[])
+{
+    if (argc < 3)
+    {
+        std::cerr << "usage: sim.exe -serve <socket> [-workers n] [-cache n]\n";
+        exit(EXIT_FAILURE);
+    }
+    const char * socketPath = argv[2];
+    size_t workers = DEFAULTWORKERS;
+    size_t cacheSize = DEFAULTCACHESIZE;
+    for (int i = 3; i < argc; i += 2)
+    {
+        if (i + 1 >= argc)
+        {
+            std::cerr << "Missing value for option " << argv[i] << "\n";
+            exit(EXIT_FAILURE);
+        }
+        if (strcmp(argv[i], "-workers") == 0)
+            workers = static_cast<size_t>(parseLimit(argv[i], argv[i + 1]));
+        else if (strcmp(argv[i], "-cache") == 0)
+            cacheSize = static_cast<size_t>(parseLimit(argv[i], argv[i + 1]));
+        else
+        {
+            std::cerr << "Unknown option " << argv[i] << "\n";
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (workers == 0)
+        workers = 1;
+    
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path))
+    {
+        std::cerr << "Socket path too long: " << socketPath << "\n";
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, socketPath);
+    
+    //replace a socket left behind by a previous server
+    unlink(socketPath);
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0 || bind(listenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 ||
+        listen(listenFd, SOMAXCONN) < 0)
+    {
+        std::cerr << "Could not listen on " << socketPath << ": " << strerror(errno) << "\n";
+        exit(EXIT_FAILURE);
+    }
+    
+    if (pipe(childPipe) < 0)
+    {
+        std::cerr << "Could not create pipe: " << strerror(errno) << "\n";
+        exit(EXIT_FAILURE);
+    }
+    fcntl(listenFd, F_SETFL, O_NONBLOCK);
+    fcntl(childPipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(childPipe[1], F_SETFL, O_NONBLOCK);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGCHLD, onChildExit);
+    
+    //decoded programs, most recently used first, and the connection waiting on each running job
+    std::list<std::pair<std::string, Program> > cache;
+    std::map<unsigned long long, std::list<std::pair<std::string, Program> >::iterator> cacheIndex;
+    std::map<pid_t, int> jobs;
+    
+    //connections whose request is still arriving, and complete requests waiting for a worker
+    std::list<ServerRequest> reading;
+    std::list<ServerRequest> ready;
+    
+    while (true)
+    {
+        //report finished jobs
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0 || (pid < 0 && errno == EINTR))
+        {
+            if (pid < 0 || jobs.count(pid) == 0)
+                continue;
+            int result = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            sendAll(jobs[pid], reinterpret_cast<const char *>(&result), sizeof(result));
+            close(jobs[pid]);
+            jobs.erase(pid);
+        }
+        
+        //start waiting requests on the free workers
+        while (jobs.size() < workers && !ready.empty())
+        {
+            ServerRequest request = ready.front();
+            ready.pop_front();
+            std::vector<std::string> & fields = request.fields;
+            
+            //find the decoded program, loading it on a cache miss
+            std::string path = (fields[1][0] == '/') ? fields[1] : fields[0] + "/" + fields[1];
+            std::string source;
+            Program missing;
+            const Program * program = &missing;
+            if (readSource(path.c_str(), source))
+            {
+                std::string key = (isAsmFile(fields[1].c_str()) ? "a" : "o") + source;
+                unsigned long long hash = hashSource(key);
+                std::map<unsigned long long, std::list<std::pair<std::string, Program> >::iterator>::iterator
+                    found = cacheIndex.find(hash);
+                if (found != cacheIndex.end() && found->second->first == key)
+                {
+                    cache.splice(cache.begin(), cache, found->second);
+                }
+                else
+                {
+                    if (found != cacheIndex.end()) //hash collision; the newer program replaces the older
+                    {
+                        cache.erase(found->second);
+                        cacheIndex.erase(found);
+                    }
+                    cache.push_front(std::make_pair(key, Program()));
+                    loadProgram(fields[1].c_str(), source, cache.front().second);
+                    cacheIndex[hash] = cache.begin();
+                    if (cache.size() > cacheSize && cache.size() > 1)
+                    {
+                        cacheIndex.erase(hashSource(cache.back().first));
+                        cache.pop_back();
+                    }
+                }
+                program = &cache.front().second;
+            }
+            else
+            {
+                missing.error = "File could not be opened.";
+            }
+            
+            std::cout.flush();
+            std::cerr.flush();
+            pid = fork();
+            if (pid == 0)
+            {
+                //job process: take over the client's descriptors and directory, then run as usual
+                signal(SIGCHLD, SIG_DFL);
+                signal(SIGPIPE, SIG_DFL);
+                close(listenFd);
+                close(childPipe[0]);
+                close(childPipe[1]);
+                close(request.connFd);
+                for (std::map<pid_t, int>::iterator job = jobs.begin(); job != jobs.end(); ++job)
+                    close(job->second);
+                for (std::list<ServerRequest>::iterator other = reading.begin(); other != reading.end(); ++other)
+                    closeRequest(*other);
+                for (std::list<ServerRequest>::iterator other = ready.begin(); other != ready.end(); ++other)
+                    closeRequest(*other);
+                for (int i = 0; i < 3; ++i)
+                {
+                    dup2(request.clientFds[i], i);
+                    if (request.clientFds[i] > 2)
+                        close(request.clientFds[i]);
+                }
+                if (chdir(fields[0].c_str()) < 0)
+                {
+                    std::cerr << "Could not change to directory " << fields[0] << "\n";
+                    exit(EXIT_FAILURE);
+                }
+                
+                std::vector<char *> jobArgs;
+                jobArgs.push_back(argv[0]);
+                for (size_t i = 1; i < fields.size(); ++i)
+                    jobArgs.push_back(&fields[i][0]);
+                SimOptions options;
+                parseOptions(static_cast<int>(jobArgs.size()), &jobArgs[0], 2, options);
+                runProgram(*program, options);
+                exit(EXIT_SUCCESS);
+            }
+            
+            for (int i = 0; i < 3; ++i)
+                close(request.clientFds[i]);
+            if (pid < 0)
+            {
+                int result = EXIT_FAILURE;
+                sendAll(request.connFd, reinterpret_cast<const char *>(&result), sizeof(result));
+                close(request.connFd);
+            }
+            else
+            {
+                jobs[pid] = request.connFd;
+            }
+        }
+        
+        //wait for a new connection, more of a request, or a finished job
+        std::vector<pollfd> waitFds(2 + reading.size());
+        waitFds[0].fd = listenFd;
+        waitFds[0].events = POLLIN;
+        waitFds[1].fd = childPipe[0];
+        waitFds[1].events = POLLIN;
+        size_t next = 2;
+        for (std::list<ServerRequest>::iterator conn = reading.begin(); conn != reading.end(); ++conn, ++next)
+        {
+            waitFds[next].fd = conn->connFd;
+            waitFds[next].events = POLLIN;
+        }
+        if (poll(&waitFds[0], waitFds.size(), -1) < 0)
+            continue;
+        if (waitFds[1].revents & POLLIN)
+        {
+            char drain[64];
+            while (read(childPipe[0], drain, sizeof(drain)) > 0) {}
+        }
+        
+        //read from the connections before accepting new ones so that waitFds still lines up
+        next = 2;
+        for (std::list<ServerRequest>::iterator conn = reading.begin(); conn != reading.end(); ++next)
+        {
+            std::list<ServerRequest>::iterator current = conn++;
+            if (waitFds[next].revents == 0)
+                continue;
+            if (!readRequest(*current))
+            {
+                closeRequest(*current);
+                reading.erase(current);
+            }
+            else if (!current->fields.empty())
+            {
+                ready.splice(ready.end(), reading, current);
+            }
+        }
+        
+        if (waitFds[0].revents & POLLIN)
+        {
+            int connFd;
+            while ((connFd = accept(listenFd, 0, 0)) >= 0)
+            {
+                fcntl(connFd, F_SETFL, O_NONBLOCK);
+                reading.push_back(ServerRequest());
+                reading.back().connFd = connFd;
+            }
+        }
+    }
+}
+
+//read whatever has arrived of a request; fields is filled in once the whole request is in.
+//Returns false if the connection closed early or the request is malformed.
+bool readRequest(ServerRequest & request)
+{
+    char buffer[4096];
+    int passedFds[3];
+    char control[CMSG_SPACE(sizeof(passedFds))];
+    while (true)
+    {
+        iovec dataVec;
+        dataVec.iov_base = buffer;
+        dataVec.iov_len = sizeof(buffer);
+        msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &dataVec;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        ssize_t received = recvmsg(request.connFd, &message, 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+        
+        //the client's stdin, stdout and stderr arrive with the first bytes of the request
+        cmsghdr * header = (received > 0) ? CMSG_FIRSTHDR(&message) : 0;
+        if (header != 0 && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS &&
+            header->cmsg_len == CMSG_LEN(sizeof(passedFds)))
+        {
+            memcpy(passedFds, CMSG_DATA(header), sizeof(passedFds));
+            for (int i = 0; i < 3; ++i)
+            {
+                if (request.clientFds[i] < 0)
+                    request.clientFds[i] = passedFds[i];
+                else
+                    close(passedFds[i]);
+            }
+        }
+        if (received <= 0)
+            return false;
+        request.data.append(buffer, static_cast<size_t>(received));
+        
+        unsigned int length;
+        if (request.data.size() < sizeof(length))
+            continue;
+        memcpy(&length, request.data.data(), sizeof(length));
+        if (length > MAXREQUEST || request.clientFds[2] < 0)
+            return false;
+        if (request.data.size() < sizeof(length) + length)
+            continue;
+        
+        //split the request into working directory, program file and options
+        for (size_t start = sizeof(length); start < sizeof(length) + length; )
+        {
+            size_t end = request.data.find('\0', start);
+            if (end == std::string::npos || end >= sizeof(length) + length)
+                break;
+            request.fields.push_back(request.data.substr(start, end - start));
+            start = end + 1;
+        }
+        return (request.fields.size() >= 2 && !request.fields[1].empty());
+    }
+}
+
+void closeRequest(ServerRequest & request)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        if (request.clientFds[i] >= 0)
+            close(request.clientFds[i]);
+    }
+    close(request.connFd);
+}
+
+int runClient(int argc, char * argv[])
+{
+    if (argc < 4)
+    {
+        std::cerr << "usage: sim.exe -client <socket> <file> [options]\n";
+        exit(EXIT_FAILURE);
+    }
+    
+    int connFd;
+    if (!connectServer(argv[2], connFd))
+    {
+        std::cerr << "Could not connect to simulation server at " << argv[2] << ": " << strerror(errno) << "\n";
+        exit(EXIT_FAILURE);
+    }
+    
+    //the request is the working directory, the program file and its options
+    char directory[4096];
+    if (getcwd(directory, sizeof(directory)) == 0)
+    {
+        std::cerr << "Could not determine working directory\n";
+        exit(EXIT_FAILURE);
+    }
+    std::string request(directory);
+    request += '\0';
+    for (int i = 3; i < argc; ++i)
+    {
+        request += argv[i];
+        request += '\0';
+    }
+    if (request.size() > MAXREQUEST)
+    {
+        std::cerr << "Request too large\n";
+        exit(EXIT_FAILURE);
+    }
+    
+    //send the length with stdin, stdout and stderr attached, then the request itself
+    unsigned int length = static_cast<unsigned int>(request.size());
+    int clientFds[3] = {0, 1, 2};
+    char control[CMSG_SPACE(sizeof(clientFds))];
+    memset(control, 0, sizeof(control));
+    iovec lengthVec;
+    lengthVec.iov_base = &length;
+    lengthVec.iov_len = sizeof(length);
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &lengthVec;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    cmsghdr * header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(clientFds));
+    memcpy(CMSG_DATA(header), clientFds, sizeof(clientFds));
+    
+    int result;
+    if (sendmsg(connFd, &message, 0) != static_cast<ssize_t>(sizeof(length)) ||
+        !sendAll(connFd, request.data(), request.size()) ||
+        !recvAll(connFd, reinterpret_cast<char *>(&result), sizeof(result)))
+    {
+        std::cerr << "Simulation server closed the connection\n";
+        exit(EXIT_FAILURE);
+    }
+    close(connFd);
+    return result;
+}
+
+bool connectServer(const char * socketPath, int & connFd)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    strcpy(address.sun_path, socketPath);
+    connFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    return (connFd >= 0 && connect(connFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0);
+}
+
+bool sendAll(int fd, const char * buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t sent = write(fd, buffer, length);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+        buffer += sent;
+        length -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+bool recvAll(int fd, char * buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t got = read(fd, buffer, length);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        buffer += got;
+        length -= static_cast<size_t>(got);
+    }
+    return true;
+}
+
+//64-bit FNV-1a hash of a program's contents, used as the cache key
+unsigned long long hashSource(const std::string & source)
+{
+    unsigned long long hash = 14695981039346656037ull;
+    for (size_t i = 0; i < source.size(); ++i)
+    {
+        hash ^= static_cast<unsigned char>(source[i]);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+unsigned long long parseLimit(const char * option, const char * value)
+{
+    char * end;
+    unsigned long long limit = strtoull(value, &end, 10);
+    if (*value == '\0' || *value == '-' || *end != '\0')
+    {
+        std::cerr << "Invalid value " << value << " for option " << option << "\n";
+        exit(EXIT_FAILURE);
+    }
+    return limit;
+}
+
+void exitOnLimit(const char * reason, int status, int progCounter, std::vector<int> & registerStore,
+                 int * dataArray, size_t numWords, std::ofstream & outFile)
+{
+    printRegisterState(registerStore,outFile);
+    outFile << "\n\n";
+    printDataMemory(dataArray,numWords,outFile);
+    outFile << "\n\n";
+    outFile << "PC: " << progCounter << "\n";
+    outFile << reason << " reached\n";
+    outFile.close();
+    exit(status);
+}
+
+//describe the source line of the instruction at progCounter for a runtime message, or nothing when
+//the program was not assembled from source
+std::string sourceNote(const Program & program, int progCounter)
+{
+    if (progCounter < 0 || static_cast<size_t>(progCounter) >= program.sourceLines.size())
+        return "";
+    return " (" + program.sourceName + ":" + std::to_string(program.sourceLines[progCounter]) + ")";
+}
+
+//write value right-aligned in a field of the given width (as std::setw would) and return the
+//position following it.  Digits are produced two at a time from digitPairs.
+char * formatInt(char * out, int value, int width)
+{
+    static const char digitPairs[201] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    
+    char digits[12];
+    char * end = digits + sizeof(digits);
+    char * start = end;
+    unsigned int magnitude = (value < 0) ? (0u - static_cast<unsigned int>(value)) : static_cast<unsigned int>(value);
+    
+    while (magnitude >= 100)
+    {
+        unsigned int pair = (magnitude % 100) * 2;
+        magnitude /= 100;
+        *--start = digitPairs[pair + 1];
+        *--start = digitPairs[pair];
+    }
+    if (magnitude >= 10)
+    {
+        *--start = digitPairs[magnitude * 2 + 1];
+        *--start = digitPairs[magnitude * 2];
+    }
+    else
+    {
+        *--start = static_cast<char>('0' + magnitude);
+    }
+    if (value < 0)
+        *--start = '-';
+    
+    for (int pad = width - static_cast<int>(end - start); pad > 0; --pad)
+        *out++ = ' ';
+    memcpy(out, start, end - start);
+    return out + (end - start);
+}
+
+void printRegisterState(std::vector<int> & registerStore, std::ofstream & outFile)
+{
+    //register labels, already right-aligned to a width of 10
+    static const char * const regLabels[34] = {
+        "   $zero =", "     $at =", "     $v0 =", "     $v1 =", "     $a0 =", "     $a1 =",
+        "     $a2 =", "     $a3 =", "     $t0 =", "     $t1 =", "     $t2 =", "     $t3 =",
+        "     $t4 =", "     $t5 =", "     $t6 =", "     $t7 =", "     $s0 =", "     $s1 =",
+        "     $s2 =", "     $s3 =", "     $s4 =", "     $s5 =", "     $s6 =", "     $s7 =",
+        "     $t8 =", "     $t9 =", "     $k0 =", "     $k1 =", "     $gp =", "     $sp =",
+        "     $fp =", "     $ra =", "     $lo =", "     $hi ="
+    };
+    
+    char buffer[1024];
+    char * pos = buffer;
+    memcpy(pos, "\nregs:\n", 7);
+    pos += 7;
+    
+    //four registers per line
+    for (size_t i = 0; i < 34; ++i)
+    {
+        memcpy(pos, regLabels[i], 10);
+        pos = formatInt(pos + 10, registerStore[i], 6);
+        if ((i % 4) == 3)
+            *pos++ = '\n';
+    }
+    outFile.write(buffer, pos - buffer);
+}
+
+void printDataMemory(int * dataArray, size_t numWords, std::ofstream & outFile)
+{
+    static char buffer[DUMPBUFFERSIZE];
+    char * pos = buffer;
+    memcpy(pos, "data memory:\n", 13);
+    pos += 13;
+    
+    //three words per line
+    for (size_t i = 0; i < numWords; ++i)
+    {
+        //flush when the buffer cannot hold another entry (at most 1 + 8 + 11 + 3 + 11 bytes)
+        if (pos > buffer + DUMPBUFFERSIZE - 64)
+        {
+            outFile.write(buffer, pos - buffer);
+            pos = buffer;
+        }
+        if ((i != 0) && (i % 3) == 0)
+        {
+            *pos++ = '\n';
+        }
+        memcpy(pos, "   data[", 8);
+        pos = formatInt(pos + 8, static_cast<int>(i), 3);
+        memcpy(pos, "] =", 3);
+        pos = formatInt(pos + 3, dataArray[i], 6);
+    }
+    *pos++ = '\n';
+    outFile.write(buffer, pos - buffer);
+}
+
+//Determine whether the loop from header to backEdge can be fast-forwarded.  The body may hold only
+//addu, addiu, subu and slt plus a single exit test: either the backward beq/bne itself, or one
+//forward beq/bne leaving a loop closed by j.  Each iteration is evaluated symbolically as an affine
+//map over the registers; slt results may only feed the exit test.  The exit test must compare two
+//values that each change by a constant every iteration so that the trip count has a closed form.
+void analyzeLoop(const std::vector<unsigned int> & encodings, int header, int backEdge, LoopPlan & plan)
+{
+    plan.valid = false;
+    
+    //symbolic register values; sltResult marks registers holding slt(sltLeft,sltRight), and
+    //registers that are neither affine nor slt results are unknown
+    std::vector<affineExpr> value(34, affineExpr(AFFINECONST + 1, 0));
+    std::vector<bool> affine(34, true);
+    std::vector<bool> sltResult(34, false);
+    std::vector<affineExpr> sltLeft(34);
+    std::vector<affineExpr> sltRight(34);
+    std::vector<bool> written(34, false);
+    std::vector<bool> readFromStart(34, false);
+    std::vector<bool> writtenAfterExit(34, false);
+    for (size_t r = 1; r < 34; ++r)
+        value[r][r] = 1;
+    
+    unsigned int backOpcode = encodings[backEdge] >> 26;
+    int exitPC = (backOpcode == 2) ? -1 : backEdge; //the bottom branch is the exit test unless it is a j
+    bool exitWhenTaken = (backOpcode == 2);
+    bool exitIsBeq = false;
+    bool exitOnSlt = false;
+    
+    for (int pc = header; pc <= backEdge; ++pc)
+    {
+        unsigned int encoding = encodings[pc];
+        unsigned int opcode = encoding >> 26;
+        unsigned int rs = (encoding >> 21) & 31;
+        unsigned int rt = (encoding >> 16) & 31;
+        unsigned int rd = (encoding >> 11) & 31;
+        unsigned int funct = encoding & 63;
+        short immSigned = static_cast<short>(encoding & 0xffff);
+        
+        if (opcode == 4 || opcode == 5)
+        {
+            int target = pc + immSigned;
+            if (pc == backEdge)
+            {
+                if (target != header)
+                    return;
+            }
+            else if (exitPC != -1 || (target >= header && target <= backEdge))
+                return; //more than one exit, or control flow inside the body
+            else
+                exitPC = pc;
+            
+            if (!written[rs]) readFromStart[rs] = true;
+            if (!written[rt]) readFromStart[rt] = true;
+            exitIsBeq = (opcode == 4);
+            
+            //remember the operands as they stand at the exit test; an slt result may only be
+            //compared against $zero
+            exitOnSlt = !(affine[rs] && affine[rt]);
+            if (!exitOnSlt)
+            {
+                plan.left = value[rs];
+                plan.right = value[rt];
+            }
+            else if ((rs == 0 && sltResult[rt]) || (rt == 0 && sltResult[rs]))
+            {
+                plan.left = sltLeft[rs + rt];
+                plan.right = sltRight[rs + rt];
+            }
+            else
+                return;
+            continue;
+        }
+        if (opcode == 2)
+        {
+            if (pc != backEdge)
+                return;
+            continue;
+        }
+        
+        //only simple register arithmetic is allowed in the body
+        unsigned int dest;
+        bool isSlt = false;
+        affineExpr result(AFFINECONST + 1, 0);
+        bool resultAffine = true;
+        if (opcode == 9) //addiu
+        {
+            dest = rt;
+            if (!written[rs]) readFromStart[rs] = true;
+            resultAffine = affine[rs];
+            result = value[rs];
+            result[AFFINECONST] += static_cast<unsigned int>(static_cast<int>(immSigned));
+        }
+        else if (opcode == 0 && (funct == 33 || funct == 35 || funct == 42)) //addu, subu, slt
+        {
+            dest = rd;
+            if (!written[rs]) readFromStart[rs] = true;
+            if (!written[rt]) readFromStart[rt] = true;
+            resultAffine = affine[rs] && affine[rt];
+            if (funct == 42)
+            {
+                if (!resultAffine)
+                    return;
+                isSlt = true;
+                resultAffine = false;
+            }
+            else
+            {
+                for (size_t i = 0; i <= AFFINECONST; ++i)
+                    result[i] = (funct == 33) ? (value[rs][i] + value[rt][i]) : (value[rs][i] - value[rt][i]);
+            }
+        }
+        else
+            return;
+        
+        if (dest == 0) //writes to $zero are discarded
+            continue;
+        if (isSlt)
+        {
+            sltLeft[dest] = value[rs];
+            sltRight[dest] = value[rt];
+        }
+        value[dest] = result;
+        affine[dest] = resultAffine;
+        sltResult[dest] = isSlt;
+        written[dest] = true;
+        if (exitPC != -1 && pc > exitPC)
+            writtenAfterExit[dest] = true;
+    }
+    if (exitPC == -1)
+        return;
+    
+    //registers that are not affine must be recomputed before the exit test of the final iteration
+    //and must not carry a value from one iteration into the next
+    for (size_t r = 1; r < 34; ++r)
+    {
+        if (!affine[r] && (readFromStart[r] || writtenAfterExit[r]))
+            return;
+    }
+    
+    //the exit operands must advance by a constant each iteration
+    if (!affineStep(plan.left, value, plan.leftStep) || !affineStep(plan.right, value, plan.rightStep))
+        return;
+    
+    if (exitOnSlt)
+    {
+        //slt result compared against $zero: beq is taken when the slt is false
+        bool takenWhenLess = !exitIsBeq;
+        plan.condition = (takenWhenLess == exitWhenTaken) ? EXIT_IF_LESS : EXIT_IF_NOTLESS;
+    }
+    else
+    {
+        plan.condition = (exitIsBeq == exitWhenTaken) ? EXIT_IF_EQUAL : EXIT_IF_NOTEQUAL;
+    }
+    
+    plan.changed.clear();
+    plan.next.clear();
+    for (unsigned int r = 1; r < 34; ++r)
+    {
+        if (written[r] && affine[r])
+        {
+            plan.changed.push_back(r);
+            plan.next.push_back(value[r]);
+        }
+    }
+    plan.bodyLength = static_cast<unsigned int>(backEdge - header + 1);
+    plan.valid = true;
+}
+
+//Skip all complete iterations of an analyzed loop that precede the one in which it exits, leaving
+//the final iteration to be stepped normally.  registerStore must hold the state at the loop
+//header.  Returns false (and changes nothing) when the trip count cannot be determined exactly or
+//the instruction budget would not cover the skipped iterations.
+bool fastForwardLoop(const LoopPlan & plan, std::vector<int> & registerStore, unsigned long long & instBudget)
+{
+    unsigned int left = affineEval(plan.left, registerStore);
+    unsigned int right = affineEval(plan.right, registerStore);
+    unsigned long long iterations;
+    
+    if (plan.condition == EXIT_IF_EQUAL || plan.condition == EXIT_IF_NOTEQUAL)
+    {
+        //the difference of the operands changes by step each iteration, modulo 2^32
+        unsigned int diff = left - right;
+        unsigned int step = plan.leftStep - plan.rightStep;
+        if (plan.condition == EXIT_IF_NOTEQUAL)
+        {
+            if (diff != 0 || step == 0)
+                return false;
+            iterations = 1;
+        }
+        else
+        {
+            if (diff == 0 || step == 0)
+                return false;
+            //solve diff + iterations * step == 0 (mod 2^32)
+            unsigned int twos = 0;
+            while (((step >> twos) & 1) == 0)
+                ++twos;
+            unsigned int target = 0u - diff;
+            if ((target & ((1u << twos) - 1)) != 0)
+                return false; //the operands never become equal
+            unsigned int odd = step >> twos;
+            unsigned int inverse = odd; //Newton's iteration for the inverse of an odd number mod 2^32
+            for (int i = 0; i < 5; ++i)
+                inverse *= 2u - odd * inverse;
+            unsigned long long modulus = 1ull << (32 - twos);
+            iterations = (static_cast<unsigned long long>((target >> twos) * inverse)) & (modulus - 1);
+        }
+    }
+    else
+    {
+        //the signed comparison is linear in the iteration count until either operand wraps
+        long long leftStart = static_cast<int>(left);
+        long long rightStart = static_cast<int>(right);
+        long long leftStep = static_cast<int>(plan.leftStep);
+        long long rightStep = static_cast<int>(plan.rightStep);
+        long long gap = rightStart - leftStart;  //left < right while gap > 0
+        long long slope = rightStep - leftStep;
+        bool wantLess = (plan.condition == EXIT_IF_LESS);
+        if ((gap > 0) == wantLess || slope == 0)
+            return false;
+        if (wantLess)
+        {
+            if (slope < 0)
+                return false;
+            iterations = static_cast<unsigned long long>(-gap / slope + 1);
+        }
+        else
+        {
+            if (slope > 0)
+                return false;
+            iterations = static_cast<unsigned long long>((gap + (-slope) - 1) / (-slope));
+        }
+        long long leftEnd = leftStart + static_cast<long long>(iterations) * leftStep;
+        long long rightEnd = rightStart + static_cast<long long>(iterations) * rightStep;
+        if (leftEnd < INT_MIN || leftEnd > INT_MAX || rightEnd < INT_MIN || rightEnd > INT_MAX)
+            return false;
+    }
+    
+    if (iterations == 0 || iterations * plan.bodyLength > instBudget)
+        return false;
+    
+    //build the iteration as a matrix over the changed registers plus a constant, folding the
+    //registers the loop never writes into the constant, then raise it to the iteration count
+    size_t n = plan.changed.size() + 1;
+    std::vector<unsigned int> matrix(n * n, 0);
+    std::vector<unsigned int> power(n * n, 0);
+    std::vector<unsigned int> scratch(n * n);
+    std::vector<bool> isChanged(34, false);
+    for (size_t i = 0; i < plan.changed.size(); ++i)
+        isChanged[plan.changed[i]] = true;
+    for (size_t row = 0; row < plan.changed.size(); ++row)
+    {
+        const affineExpr & expr = plan.next[row];
+        unsigned int constant = expr[AFFINECONST];
+        for (size_t col = 0; col < plan.changed.size(); ++col)
+            matrix[row * n + col] = expr[plan.changed[col]];
+        for (size_t r = 1; r < 34; ++r)
+        {
+            if (!isChanged[r])
+                constant += expr[r] * static_cast<unsigned int>(registerStore[r]);
+        }
+        matrix[row * n + n - 1] = constant;
+    }
+    matrix[n * n - 1] = 1;
+    for (size_t i = 0; i < n; ++i)
+        power[i * n + i] = 1;
+    
+    for (unsigned long long remaining = iterations; remaining != 0; remaining >>= 1)
+    {
+        if (remaining & 1)
+        {
+            for (size_t i = 0; i < n; ++i)
+                for (size_t j = 0; j < n; ++j)
+                {
+                    unsigned int sum = 0;
+                    for (size_t k = 0; k < n; ++k)
+                        sum += power[i * n + k] * matrix[k * n + j];
+                    scratch[i * n + j] = sum;
+                }
+            power.swap(scratch);
+        }
+        for (size_t i = 0; i < n; ++i)
+            for (size_t j = 0; j < n; ++j)
+            {
+                unsigned int sum = 0;
+                for (size_t k = 0; k < n; ++k)
+                    sum += matrix[i * n + k] * matrix[k * n + j];
+                scratch[i * n + j] = sum;
+            }
+        matrix.swap(scratch);
+    }
+    
+    std::vector<int> result(plan.changed.size());
+    for (size_t row = 0; row < plan.changed.size(); ++row)
+    {
+        unsigned int sum = power[row * n + n - 1];
+        for (size_t col = 0; col < plan.changed.size(); ++col)
+            sum += power[row * n + col] * static_cast<unsigned int>(registerStore[plan.changed[col]]);
+        result[row] = static_cast<int>(sum);
+    }
+    for (size_t row = 0; row < plan.changed.size(); ++row)
+        registerStore[plan.changed[row]] = result[row];
+    
+    instBudget -= iterations * plan.bodyLength;
+    return true;
+}
+
+//evaluate an affine expression for the given register values
+unsigned int affineEval(const affineExpr & expr, const std::vector<int> & registerStore)
+{
+    unsigned int sum = expr[AFFINECONST];
+    for (size_t r = 1; r < 34; ++r)
+        sum += expr[r] * static_cast<unsigned int>(registerStore[r]);
+    return sum;
+}
+
+//determine the constant amount by which expr changes over one iteration whose end-of-iteration
+//register values are given by next; returns false if the change depends on register values
+bool affineStep(const affineExpr & expr, const std::vector<affineExpr> & next, unsigned int & step)
+{
+    affineExpr after(AFFINECONST + 1, 0);
+    after[AFFINECONST] = expr[AFFINECONST];
+    for (size_t r = 1; r < 34; ++r)
+    {
+        if (expr[r] == 0)
+            continue;
+        for (size_t i = 0; i <= AFFINECONST; ++i)
+            after[i] += expr[r] * next[r][i];
+    }
+    for (size_t r = 1; r < 34; ++r)
+    {
+        if (after[r] != expr[r])
+            return false;
+    }
+    step = after[AFFINECONST] - expr[AFFINECONST];
+    return true;
+}
+
+bool isAsmFile(const char * fileName)
+{
+    size_t length = strlen(fileName);
+    return (length >= 4 && strcmp(fileName + length - 4, ".asm") == 0);
+}
+
+//Assemble a source file using the supported instruction set and the .text, .data, .word and
+//.space directives.  Branch offsets are relative to the branch itself and data labels evaluate to
+//their word offset from $gp, matching the object files produced by the course assembler.  Errors
+//are thrown by asmError with the source line of the offending statement.  sourceLines receives the
+//source line of each instruction.
+void assembleFile(const char * fileName, std::istream & asmFile, std::vector<unsigned int> & text,
+                  std::vector<int> & data, std::vector<size_t> & sourceLines)
+{
+    //first pass - record labels, data words and the mnemonic and operands of each instruction
+    std::map<std::string, int> textLabels;
+    std::map<std::string, int> dataLabels;
+    std::vector<std::string> mnemonics;
+    std::vector<std::vector<std::string> > operands;
+    bool inText = true;
+    std::string line;
+    size_t lineNum = 0;
+    
+    while (std::getline(asmFile, line))
+    {
+        ++lineNum;
+        line = line.substr(0, line.find('#'));
+        std::istringstream lineStream(line);
+        std::string token;
+        if (!(lineStream >> token))
+            continue;
+        
+        //labels are attached to the next instruction or data word
+        while (token[token.size() - 1] == ':')
+        {
+            std::string label = token.substr(0, token.size() - 1);
+            if (label.empty() || textLabels.count(label) || dataLabels.count(label))
+                asmError(fileName, lineNum, "invalid or duplicate label " + token);
+            if (inText)
+                textLabels[label] = static_cast<int>(mnemonics.size());
+            else
+                dataLabels[label] = static_cast<int>(data.size());
+            if (!(lineStream >> token))
+                break;
+        }
+        if (token[token.size() - 1] == ':')
+            continue;
+        
+        //split the remainder of the line into comma separated operands
+        std::string rest;
+        std::getline(lineStream, rest);
+        std::vector<std::string> args;
+        std::istringstream argStream(rest);
+        std::string arg;
+        while (std::getline(argStream, arg, ','))
+        {
+            size_t first = arg.find_first_not_of(" \t\r");
+            size_t last = arg.find_last_not_of(" \t\r");
+            args.push_back((first == std::string::npos) ? "" : arg.substr(first, last - first + 1));
+        }
+        if (args.size() == 1 && args[0].empty())
+            args.clear();
+        
+        if (token == ".text")
+            inText = true;
+        else if (token == ".data")
+            inText = false;
+        else if (token == ".word" || token == ".space")
+        {
+            if (inText)
+                asmError(fileName, lineNum, token + " outside of .data");
+            if (token == ".word")
+            {
+                for (size_t i = 0; i < args.size(); ++i)
+                    data.push_back(asmNumber(fileName, lineNum, args[i]));
+            }
+            else
+            {
+                int count = (args.size() == 1) ? asmNumber(fileName, lineNum, args[0]) : -1;
+                if (count < 0)
+                    asmError(fileName, lineNum, "invalid .space count");
+                if (static_cast<size_t>(count) > MAXPROGRAM - data.size())
+                    asmError(fileName, lineNum, "program too large");
+                data.insert(data.end(), count, 0);
+            }
+        }
+        else if (token[0] == '.')
+            asmError(fileName, lineNum, "unsupported directive " + token);
+        else
+        {
+            if (!inText)
+                asmError(fileName, lineNum, "instruction outside of .text");
+            mnemonics.push_back(token);
+            operands.push_back(args);
+            sourceLines.push_back(lineNum);
+        }
+        
+        if (mnemonics.size() > MAXPROGRAM || data.size() > MAXPROGRAM)
+            asmError(fileName, lineNum, "program too large");
+    }
+    
+    //second pass - encode each instruction now that every label is known
+    for (size_t pc = 0; pc < mnemonics.size(); ++pc)
+    {
+        const std::string & name = mnemonics[pc];
+        const std::vector<std::string> & args = operands[pc];
+        size_t srcLine = sourceLines[pc];
+        
+        unsigned int opcode = 64;
+        unsigned int funct = 0;
+        for (unsigned int i = 0; i < 64 && opcode == 64; ++i)
+        {
+            if (functTable[i] != 0 && name == functTable[i])
+            {
+                opcode = 0;
+                funct = i;
+            }
+            else if (opcodeTable[i] != 0 && name == opcodeTable[i])
+                opcode = i;
+        }
+        if (opcode == 64)
+            asmError(fileName, srcLine, "unknown instruction " + name);
+        
+        //number of operands expected by each instruction form
+        size_t expected;
+        if (opcode == 0)
+            expected = (funct == 12) ? 0 : (funct == 16 || funct == 18) ? 1 : (funct == 24 || funct == 26) ? 2 : 3;
+        else
+            expected = (opcode == 2) ? 1 : (opcode == 35 || opcode == 43) ? 2 : 3;
+        if (args.size() != expected)
+            asmError(fileName, srcLine, "wrong number of operands for " + name);
+        
+        unsigned int encoding = opcode << 26;
+        int value;
+        std::map<std::string, int>::const_iterator label;
+        switch (opcode)
+        {
+            case 0:
+                if (expected == 3) //rd,rs,rt
+                {
+                    encoding |= asmRegister(fileName, srcLine, args[0]) << 11;
+                    encoding |= asmRegister(fileName, srcLine, args[1]) << 21;
+                    encoding |= asmRegister(fileName, srcLine, args[2]) << 16;
+                }
+                else if (expected == 2) //rs,rt
+                {
+                    encoding |= asmRegister(fileName, srcLine, args[0]) << 21;
+                    encoding |= asmRegister(fileName, srcLine, args[1]) << 16;
+                }
+                else if (expected == 1) //rd
+                {
+                    encoding |= asmRegister(fileName, srcLine, args[0]) << 11;
+                }
+                encoding |= funct;
+                break;
+            case 9: //rt,rs,imm
+                encoding |= asmRegister(fileName, srcLine, args[0]) << 16;
+                encoding |= asmRegister(fileName, srcLine, args[1]) << 21;
+                value = asmNumber(fileName, srcLine, args[2]);
+                if (value < -32768 || value > 32767)
+                    asmError(fileName, srcLine, "immediate out of range: " + args[2]);
+                encoding |= (static_cast<unsigned int>(value) & 0xffff);
+                break;
+            case 4: //rs,rt,label
+            case 5:
+                encoding |= asmRegister(fileName, srcLine, args[0]) << 21;
+                encoding |= asmRegister(fileName, srcLine, args[1]) << 16;
+                label = textLabels.find(args[2]);
+                value = (label != textLabels.end()) ? (label->second - static_cast<int>(pc))
+                                                    : asmNumber(fileName, srcLine, args[2]);
+                if (value < -32768 || value > 32767)
+                    asmError(fileName, srcLine, "branch offset out of range: " + args[2]);
+                encoding |= (static_cast<unsigned int>(value) & 0xffff);
+                break;
+            case 2: //label
+                label = textLabels.find(args[0]);
+                value = (label != textLabels.end()) ? label->second : asmNumber(fileName, srcLine, args[0]);
+                if (value < 0 || value > 0x3ffffff)
+                    asmError(fileName, srcLine, "jump target out of range: " + args[0]);
+                encoding |= static_cast<unsigned int>(value);
+                break;
+            case 35: //rt,offset(rs)
+            case 43:
+            {
+                encoding |= asmRegister(fileName, srcLine, args[0]) << 16;
+                size_t open = args[1].find('(');
+                size_t close = args[1].find(')');
+                if (open == std::string::npos || close != args[1].size() - 1 || close < open)
+                    asmError(fileName, srcLine, "invalid memory operand " + args[1]);
+                std::string offset = args[1].substr(0, open);
+                offset.erase(offset.find_last_not_of(" \t") + 1);
+                label = dataLabels.find(offset);
+                value = (label != dataLabels.end()) ? label->second
+                                                    : (offset.empty() ? 0 : asmNumber(fileName, srcLine, offset));
+                if (value < -32768 || value > 32767)
+                    asmError(fileName, srcLine, "offset out of range: " + offset);
+                encoding |= (static_cast<unsigned int>(value) & 0xffff);
+                encoding |= asmRegister(fileName, srcLine, args[1].substr(open + 1, close - open - 1)) << 21;
+                break;
+            }
+            default: //the assembler should never reach this point
+                asmError(fileName, srcLine, "unsupported instruction " + name);
+                break;
+        }
+        text.push_back(encoding);
+    }
+}
+
+//abandon assembly; loadProgram catches the error so that a server is not brought down by bad input
+void asmError(const char * fileName, size_t lineNum, const std::string & message)
+{
+    throw std::runtime_error(std::string(fileName) + ":" + std::to_string(lineNum) + ": " + message);
+}
+
+//parse a register operand given either by name ($t0) or by number ($8)
+unsigned int asmRegister(const char * fileName, size_t lineNum, const std::string & operand)
+{
+    std::string name = operand;
+    name.erase(0, name.find_first_not_of(" \t"));
+    name.erase(name.find_last_not_of(" \t") + 1);
+    if (name.size() >= 2 && name[0] == '$')
+    {
+        name = name.substr(1);
+        for (unsigned int i = 0; i < 32; ++i)
+        {
+            if (name == argTable[i])
+                return i;
+        }
+        //numbered registers have at most two digits, so atoi cannot overflow
+        if (name.size() <= 2 && name.find_first_not_of("0123456789") == std::string::npos)
+        {
+            int number = atoi(name.c_str());
+            if (number < 32)
+                return static_cast<unsigned int>(number);
+        }
+    }
+    asmError(fileName, lineNum, "invalid register " + operand);
+    return 0;
+}
+
+//parse a decimal or 0x-prefixed hexadecimal integer operand
+int asmNumber(const char * fileName, size_t lineNum, const std::string & operand)
+{
+    const char * start = operand.c_str();
+    const char * digits = (*start == '-') ? start + 1 : start;
+    int base = (digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X')) ? 16 : 10;
+    char * end;
+    long long value = strtoll(start, &end, base);
+    if (operand.empty() || *end != '\0' || value < INT_MIN || value > UINT_MAX)
+        asmError(fileName, lineNum, "invalid number or undefined label " + operand);
+    return static_cast<int>(static_cast<unsigned int>(value));
+}